@@ -0,0 +1,152 @@
+/*
+ * Microbenchmark for the escape sequence encoder used by refreshLineAlt().
+ *
+ * Compares outputCSI() and friends against the previous vsnprintf() based
+ * implementation, and checks that both produce exactly the same bytes.
+ *
+ * linenoise.c is included directly so that the static functions can be reached.
+ */
+#include "linenoise.c"
+
+#include <time.h>
+
+#if defined(BUILD_MONOLITHIC)
+#define main      linenoise_bench_escapes_main
+#endif
+
+#if defined(USE_TERMIOS)
+
+/* The previous implementation, for comparison */
+static void oldOutputFormatted(struct current *current, const char *format, ...)
+{
+	va_list args;
+	char buf[64];
+	int n;
+
+	va_start(args, format);
+	n = vsnprintf(buf, sizeof(buf), format, args);
+	assert(n < (int)sizeof(buf));
+	va_end(args);
+	outputChars(current, buf, n);
+}
+
+static void oldSetOutputHighlight(struct current *current, const int *props, int nprops)
+{
+	outputChars(current, "\x1b[", -1);
+	while (nprops--) {
+		oldOutputFormatted(current, "%d%c", *props, (nprops == 0) ? 'm' : ';');
+		props++;
+	}
+}
+
+static void oldSetCursorPos(struct current *current, int x)
+{
+	if (x == 0) {
+		cursorToLeft(current);
+	}
+	else {
+		oldOutputFormatted(current, "\r\x1b[%dC", x);
+	}
+}
+
+static void oldCursorUp(struct current *current, int n)
+{
+	if (n) {
+		oldOutputFormatted(current, "\x1b[%dA", n);
+	}
+}
+
+static void oldCursorDown(struct current *current, int n)
+{
+	if (n) {
+		oldOutputFormatted(current, "\x1b[%dB", n);
+	}
+}
+
+/* The sequences output by a typical refresh of a coloured multiline prompt */
+static const int reset[] = { 0 };
+static const int hint[] = { 1, 37, 49 };
+static const int prompt[] = { 0, 1, 34 };
+
+static void frame_old(struct current *current, int i)
+{
+	oldCursorUp(current, 1 + i % 3);
+	oldSetCursorPos(current, i % 120);
+	oldSetOutputHighlight(current, prompt, 3);
+	oldSetOutputHighlight(current, reset, 1);
+	oldCursorDown(current, 1);
+	oldSetCursorPos(current, 7);
+	oldSetOutputHighlight(current, hint, 3);
+	oldSetOutputHighlight(current, reset, 1);
+	oldCursorDown(current, 12345 + i);
+}
+
+static void frame_new(struct current *current, int i)
+{
+	cursorUp(current, 1 + i % 3);
+	setCursorPos(current, i % 120);
+	setOutputHighlight(current, prompt, 3);
+	setOutputHighlight(current, reset, 1);
+	cursorDown(current, 1);
+	setCursorPos(current, 7);
+	setOutputHighlight(current, hint, 3);
+	setOutputHighlight(current, reset, 1);
+	cursorDown(current, 12345 + i);
+}
+
+static double bench(const char *name, void (*frame)(struct current *, int), struct current *current, int count)
+{
+	clock_t start = clock();
+	double secs;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		sb_clear(current->output);
+		frame(current, i);
+	}
+	secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+	printf("%-10s %8.1f ns/frame\n", name, secs * 1e9 / count);
+	return secs;
+}
+
+int main(int argc, char *argv[])
+{
+	struct current current;
+	stringbuf *expected = sb_alloc();
+	int count = (argc > 1) ? atoi(argv[1]) : 1000000;
+	int i;
+
+	memset(&current, 0, sizeof(current));
+	current.output = sb_alloc();
+
+	/* Check that the output is unchanged */
+	for (i = 0; i < 1000; i++) {
+		sb_clear(current.output);
+		frame_old(&current, i);
+		sb_clear(expected);
+		sb_append(expected, sb_str(current.output));
+		sb_clear(current.output);
+		frame_new(&current, i);
+		if (strcmp(sb_str(current.output), sb_str(expected)) != 0) {
+			fprintf(stderr, "Error: frame %d differs\n", i);
+			abort();
+		}
+	}
+
+	bench("vsnprintf", frame_old, &current, count);
+	bench("encoder", frame_new, &current, count);
+
+	sb_free(expected);
+	sb_free(current.output);
+	return 0;
+}
+
+#else
+
+int main(void)
+{
+	printf("Not supported on this platform\n");
+	return 0;
+}
+
+#endif
@@ -27,7 +27,13 @@ static void refreshStartChars(struct current *current)
 {
     assert(current->output == NULL);
     /* We accumulate all output here */
-    current->output = sb_alloc();
+    if (current->outbuf) {
+        sb_clear(current->outbuf);
+    }
+    else {
+        current->outbuf = tmp_sb_alloc(current);
+    }
+    current->output = current->outbuf;
 #ifdef USE_UTF8
     current->ubuflen = 0;
 #endif
@@ -43,7 +49,6 @@ static void refreshEndChars(struct current *current)
 {
     assert(current->output);
     flushOutput(current);
-    sb_free(current->output);
     current->output = NULL;
 }
 
@@ -71,6 +76,44 @@ static void disableRawMode(struct current *current)
     SetConsoleMode(current->inh, orig_consolemode);
 }
 
+/* The console mode is always restored between lines */
+static void endRawMode(struct current *current)
+{
+    disableRawMode(current);
+}
+
+void linenoiseSetKeepRawMode(int enable)
+{
+    (void)enable;
+}
+
+/* Sessions only check that there is a console, which is cheap to set up */
+struct linenoiseSession {
+    int unused;
+};
+
+struct linenoiseSession *linenoiseSessionOpen(void)
+{
+    struct current current;
+
+    memset(&current, 0, sizeof(current));
+    if (enableRawMode(&current) == -1) {
+        return NULL;
+    }
+    disableRawMode(&current);
+    return (struct linenoiseSession *)ln_calloc(sizeof(struct linenoiseSession));
+}
+
+void linenoiseSessionSuspend(struct linenoiseSession *s)
+{
+    (void)s;
+}
+
+void linenoiseSessionClose(struct linenoiseSession *s)
+{
+    ln_free(s);
+}
+
 void linenoiseClearScreen(void)
 {
     /* XXX: This is ugly. Should just have the caller pass a handle */
@@ -199,6 +242,11 @@ static int outputChars(struct current *current, const char *buf, int len)
     return 0;
 }
 
+static void outputRef(struct current *current, const char *buf, int len)
+{
+    outputChars(current, buf, len);
+}
+
 static void outputNewline(struct current *current)
 {
     /* On the last row output a newline to force a scroll */
@@ -307,78 +355,130 @@ static void cursorDown(struct current *current, int n)
     setCursorXY(current);
 }
 
+/**
+ * Returns the key for a console input record, or -1 if it is to be ignored,
+ * such as a key release or ctrl on its own.
+ */
+static int recordKey(const INPUT_RECORD *irec)
+{
+    KEY_EVENT_RECORD evrec;
+    BOOL altgr;
+
+    if (irec->EventType != KEY_EVENT || !irec->Event.KeyEvent.bKeyDown) {
+        return -1;
+    }
+    evrec = irec->Event.KeyEvent;
+    altgr = evrec.dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_ALT_PRESSED);
+
+    if (evrec.dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED) && !altgr) {
+
+        /* Ctrl+Key */
+        switch (evrec.uChar.UnicodeChar) {
+        case 'I':
+        case 'M':
+        case 'O':
+        case 'Q':
+        case 'S':
+        case 'X': /* These are unsupported */
+            break;
+        default:
+            if (evrec.uChar.UnicodeChar >= 'A' && evrec.uChar.UnicodeChar <= 'Z')
+                return ctrl(evrec.uChar.UnicodeChar);
+        }
+    }
+    else {
+        switch (evrec.wVirtualKeyCode) {
+        case VK_RETURN:
+            return '\n';
+        case VK_ESCAPE:
+            return SPECIAL_ESCAPE;
+        case VK_LEFT:
+            return SPECIAL_LEFT;
+        case VK_RIGHT:
+            return SPECIAL_RIGHT;
+        case VK_UP:
+            return SPECIAL_UP;
+        case VK_DOWN:
+            return SPECIAL_DOWN;
+        case VK_BACK:
+            return SPECIAL_BACKSPACE;
+        case VK_INSERT:
+            return SPECIAL_INSERT;
+        case VK_DELETE:
+            return SPECIAL_DELETE;
+        case VK_HOME:
+            return SPECIAL_HOME;
+        case VK_END:
+            return SPECIAL_END;
+        case VK_PRIOR:
+            return SPECIAL_PAGE_UP;
+        case VK_NEXT:
+            return SPECIAL_PAGE_DOWN;
+        default:
+#ifndef USE_UTF8
+            if (isascii(evrec.uChar.UnicodeChar))
+#endif
+                return evrec.uChar.UnicodeChar;
+        }
+    }
+    return -1;
+}
+
 static int fd_read(struct current *current)
 {
     DWORD n;
     INPUT_RECORD irec;
-    KEY_EVENT_RECORD evrec;
-    BOOL altgr;
+    int c;
 
     while (1) {
         if (WaitForSingleObject(current->inh, INFINITE) != WAIT_OBJECT_0) return -1;
         if (!ReadConsoleInputW(current->inh, &irec, 1, &n)) return -1;
         if (!n) return 0;
 
-        if (irec.EventType == KEY_EVENT && irec.Event.KeyEvent.bKeyDown) {
-            evrec = irec.Event.KeyEvent;
-            altgr = evrec.dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_ALT_PRESSED);
-
-            if (evrec.dwControlKeyState & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED) && !altgr) {
-
-                /* Ctrl+Key */
-                switch (evrec.uChar.UnicodeChar) {
-                case 'I':
-                case 'M':
-                case 'O':
-                case 'Q':
-                case 'S':
-                case 'X': /* These are unsupported */
-                    break;
-                default:
-                    if (evrec.uChar.UnicodeChar >= 'A' && evrec.uChar.UnicodeChar <= 'Z')
-                        return ctrl(evrec.uChar.UnicodeChar);
-                }
-            }
-            else {
-                switch (evrec.wVirtualKeyCode) {
-                case VK_RETURN:
-                    return '\n';
-                case VK_ESCAPE:
-                    return SPECIAL_ESCAPE;
-                case VK_LEFT:
-                    return SPECIAL_LEFT;
-                case VK_RIGHT:
-                    return SPECIAL_RIGHT;
-                case VK_UP:
-                    return SPECIAL_UP;
-                case VK_DOWN:
-                    return SPECIAL_DOWN;
-                case VK_BACK:
-                    return SPECIAL_BACKSPACE;
-                case VK_INSERT:
-                    return SPECIAL_INSERT;
-                case VK_DELETE:
-                    return SPECIAL_DELETE;
-                case VK_HOME:
-                    return SPECIAL_HOME;
-                case VK_END:
-                    return SPECIAL_END;
-                case VK_PRIOR:
-                    return SPECIAL_PAGE_UP;
-                case VK_NEXT:
-                    return SPECIAL_PAGE_DOWN;
-                default:
-#ifndef USE_UTF8
-                    if (isascii(evrec.uChar.UnicodeChar))
-#endif
-                        return evrec.uChar.UnicodeChar;
-                }
-            }
+        c = recordKey(&irec);
+        if (c != -1) {
+            return c;
         }
     }
     return -1;
 }
 
+/* Returns 1 if fd_read() can return a key without waiting, otherwise 0 */
+static int fd_char_ready(struct current *current)
+{
+    DWORD n;
+    INPUT_RECORD irec;
+
+    while (PeekConsoleInputW(current->inh, &irec, 1, &n) && n) {
+        if (recordKey(&irec) != -1) {
+            return 1;
+        }
+        /* Discard anything fd_read() would ignore */
+        ReadConsoleInputW(current->inh, &irec, 1, &n);
+    }
+    return 0;
+}
+
+/* Refreshes are never put off on the console */
+static int fd_input_pending(struct current *current)
+{
+    (void)current;
+    return 0;
+}
+
+/* The console reports keys rather than sequences */
+int linenoiseAddKeySequence(const char *seq, int key)
+{
+    (void)seq;
+    (void)key;
+    return -1;
+}
+
+void linenoiseSetEscapeTimeout(int ms)
+{
+    (void)ms;
+}
+
 static int getWindowSize(struct current *current)
 {
     CONSOLE_SCREEN_BUFFER_INFO info;
@@ -136,8 +136,10 @@
 #endif
 #else
 #include <termios.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
 #define USE_TERMIOS
 #define HAVE_UNISTD_H
 #endif
@@ -169,6 +171,8 @@
 #endif
 
 #define LINENOISE_DEFAULT_HISTORY_MAX_LEN 100
+#define LINENOISE_DEFAULT_MAX_REFRESH_DELAY 50
+#define LINENOISE_DEFAULT_ESCAPE_TIMEOUT 50
 
 #define TAB_WIDTH 8
 
@@ -196,27 +200,249 @@ enum {
     SPECIAL_INSERT = -3,
     SPECIAL_PAGE_UP = -4,
     SPECIAL_PAGE_DOWN = -5,
+    SPECIAL_PASTE = -6,     /* start of a bracketed paste */
 };
 
+/* Where a history entry is kept in history_text */
+struct historyslot {
+    int offset;         /* index of the null terminated entry */
+    int len;            /* length, not including the null */
+};
+
+/* The history is a circular buffer of 'history_alloc' slots, of which
+ * 'history_len' are used, starting with the oldest entry at 'history_start'.
+ * See history_entry()
+ *
+ * The entries themselves are all kept in one block, history_text, in order
+ * from oldest, other than those changed while editing. Entries that are
+ * dropped or replaced leave 'history_dead' bytes unused until the block is
+ * compacted. See history_store()
+ */
 static int history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
 static int history_len = 0;
 static int history_index = 0;
-static char **history = NULL;
+static struct historyslot *history = NULL;
+static int history_alloc = 0;
+static int history_start = 0;
+static char *history_text = NULL;
+static int history_textlen = 0;     /* bytes used in history_text, including dead bytes */
+static int history_textalloc = 0;   /* allocated size of history_text */
+static int history_dead = 0;
+static char **history_list = NULL;  /* returned by linenoiseHistory() */
+
+/* Compact history_text once there are at least this many dead bytes,
+ * and they are at least half of it */
+#define HISTORY_COMPACT_MIN 4096
+
+/**
+ * Returns the slot for history entry 'n', where 0 is the oldest.
+ */
+static struct historyslot *history_entry(int n)
+{
+    n += history_start;
+    if (n >= history_alloc) {
+        n -= history_alloc;
+    }
+    return &history[n];
+}
+
+/**
+ * Returns the text of history entry 'n', where 0 is the oldest.
+ */
+static char *history_str(int n)
+{
+    return history_text + history_entry(n)->offset;
+}
+
+/* Bytes of a cell kept in the screen model. A char plus combining chars may
+ * need more, in which case the cell never compares equal and is always redrawn.
+ */
+#define CELL_BYTES 8
+/* cell.len for a cell whose bytes did not fit in cell.ch[] */
+#define CELL_OVERFLOW 255
+/* Maximum number of SGR properties that make up one attribute */
+#define MAX_ATTR_PROPS 16
+
+/* One display column of the screen model. See refreshLineAlt() */
+struct cell {
+    unsigned short attr;    /* index into screen.attrs[] */
+    unsigned char width;    /* 1 or 2, or 0 for the right half of a wide char */
+    unsigned char len;      /* number of bytes in ch[] (0 for blank), or CELL_OVERFLOW */
+    char ch[CELL_BYTES];    /* utf-8 bytes displayed in this cell */
+};
+
+/* A display attribute is the list of SGR properties in effect */
+struct attr {
+    int nprops;
+    int props[MAX_ATTR_PROPS];
+};
+
+/* What refreshLineAlt() last drew on the terminal */
+struct screen {
+    struct cell *cells; /* rows x cols cells */
+    int *rowwidth;      /* number of columns in use on each row */
+    int rows;           /* number of rows allocated in cells[] and rowwidth[] */
+    int cols;           /* number of columns per row in cells[] */
+    int valid;          /* 0 if the terminal contents no longer match cells[] */
+    int col;            /* column of the cursor. The row is current->rpos */
+    int attr;           /* attribute currently in effect on the terminal */
+    int inchars;        /* set between refreshStartChars() and refreshEndChars() */
+    struct attr *attrs; /* attribute table. attrs[0] is the default attribute */
+    int nattrs;         /* number of entries in attrs[] */
+    const char *prompt; /* arguments of the last refreshLineAlt(), to redraw after a resize */
+    const char *buf;    /* buffer of the last refresh, or NULL if it was current->buf */
+    int pos;            /* cursor position of the last refresh if buf is not NULL */
+    int haveprompt;     /* the compiled current->prompt is on the terminal */
+};
+
+/* Where one char of the buffer was laid out by refreshLineAlt() */
+struct charpos {
+    int offset;         /* byte offset of the char in the buffer */
+    int row;            /* display row of the char */
+    int col;            /* display column of the char */
+    int width;          /* display width of the char, 0 for combining chars */
+    int attr;           /* attribute in effect after the char */
+};
+
+/* Layout of current->buf from the last refresh. In multiline mode the next
+ * refresh need only lay out the chars from the first edited one onward,
+ * and in either mode the cursor can be moved without a refresh.
+ */
+struct linecache {
+    char *prompt;           /* copy of the prompt laid out before the buffer, or NULL if empty */
+    int cols;               /* window width used for the layout */
+    struct charpos *chars;  /* position of each char of the buffer, starting from char 'first' */
+    int first;              /* first char shown. Only single line mode skips chars */
+    int nchars;             /* number of chars laid out */
+    int valid;              /* chars[0..valid-1] have not been edited since (multiline mode) */
+    int alloc;              /* number of entries allocated in chars[] */
+    int shown;              /* the terminal shows this layout, and the buffer is unchanged */
+    int maxcursor;          /* the cursor can move up to this char without scrolling the line */
+    int shift;              /* cells inserted (> 0) or deleted (< 0) by the one edit since shown */
+    int shiftrow;           /* ... at this position */
+    int shiftcol;
+};
+
+#ifndef NO_COMPLETION
+/* The hint for one revision of the buffer. See refreshShowHints() */
+struct hintcache {
+    int valid;              /* the hint is for current->buf as of 'revision' */
+    unsigned revision;
+    linenoiseHintsCallback *callback; /* the callback and userdata that returned the hint */
+    void *userdata;
+    char *hint;             /* as returned by the callback, or NULL */
+    int color;
+    int bold;
+};
+#endif
+
+/* Most pieces of output that refreshLine() may refer to rather than copy */
+#define MAX_OUTPUT_REFS 4
+
+/* A piece of output that is written from where it is rather than copied */
+struct outputref {
+    int offset;         /* where the piece goes in current->output */
+    const char *data;
+    int len;
+};
+
+/* Size of the ring buffer for input read from the terminal but not yet used */
+#define INPUT_BUF_SIZE 4096
+
+/* Room in the ring that only queryCursor() may fill, so that the reply
+ * can always be read however much typeahead is waiting.
+ */
+#define INPUT_BUF_RESERVE 32
+
+/* Input from the terminal. See fd_fill() */
+struct inputbuf {
+    unsigned char data[INPUT_BUF_SIZE];
+    int head;           /* index of the next byte to use */
+    int count;          /* number of bytes from 'head' not yet used */
+};
+
+/* Memory used while editing one line, released all at once. See arenaRealloc() */
+struct arena {
+    struct arenablock *blocks; /* the block allocated from, then the earlier ones */
+    sb_allocator alloc;     /* allocates stringbufs from the arena */
+};
+
+/* One change to the buffer in the undo journal. See undoRecord() */
+struct undoentry {
+    int offset;         /* byte index of the change */
+    int at;             /* ... in chars */
+    int cursor;         /* current->pos before the change */
+    int dellen;         /* number of bytes deleted at 'offset' */
+    int inslen;         /* number of bytes then inserted at 'offset' */
+    int text;           /* index in the journal text of the deleted bytes, then the inserted bytes */
+    int joined;         /* undone and redone together with the entry before */
+};
+
+/* The changes made to the line being edited, for undo (ctrl-_) and redo (meta-_) */
+struct undojournal {
+    struct undoentry *entries;
+    int alloc;          /* allocated size of entries[] */
+    int count;          /* number of entries */
+    int pos;            /* number of entries applied. The rest can be redone */
+    stringbuf *text;    /* the bytes deleted and inserted, for each entry in turn */
+    unsigned revision;  /* sb_revision() of current->buf after the last entry */
+    int typing;         /* the last entry is typed chars, so more can be added to it */
+    int group;          /* entries are joined until undoGroupEnd() */
+    int join;           /* ... and the next one is joined to the one before */
+};
+
+/* What the next key is for. See linenoiseEditKey() */
+enum {
+    EDIT_NORMAL,
+    EDIT_LITERAL,       /* after ctrl-V, insert the next key as is */
+    EDIT_COMPLETE,      /* choosing a tab completion */
+    EDIT_SEARCH,        /* reverse incremental search */
+    EDIT_PASTE,         /* reading the rest of a bracketed paste */
+};
+
+/* State of a reverse incremental search (ctrl-R) */
+struct searchstate {
+    char buf[50];       /* the text searched for */
+    int chars;          /* ... in chars */
+    int len;            /* ... in bytes */
+    int pos;            /* index of the history entry matched */
+    char prompt[80];    /* the prompt shown during the search */
+};
 
 /* Structure to contain the status of the current (being edited) line */
 struct current {
     stringbuf *buf;     /* Current buffer. Always null terminated */
     int pos;            /* Cursor position, measured in chars */
     int cols;           /* Size of the window, in chars */
-    int nrows;          /* How many rows are being used in multiline mode (>= 1) */
-    int rpos;           /* The current row containing the cursor - multiline mode only */
-    int colsright;      /* refreshLine() cached cols for insert_char() optimisation */
-    int colsleft;       /* refreshLine() cached cols for remove_char() optimisation */
+    int nrows;          /* How many rows have been used on the terminal (>= 1) */
+    int rpos;           /* The current row containing the cursor */
+    struct screen screen; /* model of the terminal contents for refreshLineAlt() */
+    struct linecache linecache; /* layout of buf from the last multiline refresh */
+    struct promptlayout *promptlayout; /* current->prompt, laid out once */
+#ifndef NO_COMPLETION
+    struct hintcache hintcache; /* the last hint returned by hintsCallback */
+#endif
+    int refreshpending; /* refreshLine() was put off because more input is waiting */
+    long refreshdeadline; /* ... and must be done by this time (ms) regardless */
+    int mode;           /* EDIT_xxx, what the next key is for */
+#ifndef NO_COMPLETION
+    linenoiseCompletions completions; /* the choices, in EDIT_COMPLETE mode */
+    size_t completion;  /* the choice shown, or completions.len for the original line */
+#endif
+    struct searchstate search; /* in EDIT_SEARCH mode */
     const char *prompt;
     stringbuf *capture; /* capture buffer, or NULL for none. Always null terminated */
     stringbuf *output;  /* used only during refreshLine() - output accumulator */
+    stringbuf *outbuf;  /* storage for output, kept for the whole session */
+    struct arena arena; /* memory used until the end of the edit */
+    struct undojournal undo; /* changes to buf, kept in the arena */
 #if defined(USE_TERMIOS)
     int fd;             /* Terminal fd */
+    struct outputref outrefs[MAX_OUTPUT_REFS]; /* pieces of the output not copied into output */
+    int noutrefs;       /* number of entries in outrefs[] */
+    struct inputbuf input; /* bytes read from fd, but not yet used */
+    stringbuf *paste;   /* the text pasted so far, in EDIT_PASTE mode */
+    int pasteprev;      /* the last byte of it that was read */
 #elif defined(USE_WINCONSOLE)
     HANDLE outh;        /* Console output handle */
     HANDLE inh;         /* Console input handle */
@@ -233,6 +459,8 @@ struct current {
 };
 
 static int fd_read(struct current *current);
+static int fd_input_pending(struct current *current);
+static void outputRef(struct current *current, const char *buf, int len);
 static int getWindowSize(struct current *current);
 static void cursorDown(struct current *current, int n);
 static void cursorUp(struct current *current, int n);
@@ -243,6 +471,192 @@ static void setCursorPos(struct current *current, int x);
 static void setOutputHighlight(struct current *current, const int *props, int nprops);
 static void set_current(struct current *current, const char *str);
 
+/* Memory allocation, see linenoiseSetAllocator() */
+static void *(*malloc_fn)(size_t) = malloc;
+static void *(*realloc_fn)(void *, size_t) = realloc;
+static void (*free_fn)(void *) = free;
+
+static void *ln_malloc(size_t size)
+{
+    return malloc_fn(size);
+}
+
+static void *ln_calloc(size_t size)
+{
+    void *ptr = malloc_fn(size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+static void *ln_realloc(void *ptr, size_t size)
+{
+    return ptr ? realloc_fn(ptr, size) : malloc_fn(size);
+}
+
+static void ln_free(void *ptr)
+{
+    if (ptr) {
+        free_fn(ptr);
+    }
+}
+
+static char *ln_strdup(const char *str)
+{
+    size_t size = strlen(str) + 1;
+    return (char *)memcpy(ln_malloc(size), str, size);
+}
+
+static void *heapRealloc(void *userdata, void *ptr, size_t size)
+{
+    (void)userdata;
+    if (size == 0) {
+        ln_free(ptr);
+        return NULL;
+    }
+    return ln_realloc(ptr, size);
+}
+
+/* For stringbufs allocated with the functions above */
+static const sb_allocator heap_allocator = { heapRealloc, NULL };
+
+void linenoiseSetAllocator(void *(*mallocfn)(size_t), void *(*reallocfn)(void *, size_t), void (*freefn)(void *))
+{
+    if (mallocfn && reallocfn && freefn) {
+        malloc_fn = mallocfn;
+        realloc_fn = reallocfn;
+        free_fn = freefn;
+        sb_set_allocator(&heap_allocator);
+    }
+    else {
+        malloc_fn = malloc;
+        realloc_fn = realloc;
+        free_fn = free;
+        sb_set_allocator(NULL);
+    }
+}
+
+/* Allocations from an arena are aligned to this, and preceded by their size */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(N) (((N) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* The size of the first block of an arena. Each later one is twice the size */
+#define ARENA_BLOCK_SIZE 4096
+
+struct arenablock {
+    struct arenablock *next; /* the block before this one */
+    size_t size;        /* bytes available after the header */
+    size_t used;        /* ... of which this many are allocated */
+};
+
+#define ARENA_HEADER ARENA_ROUND(sizeof(struct arenablock))
+
+static char *arenaData(struct arenablock *block)
+{
+    return (char *)block + ARENA_HEADER;
+}
+
+static size_t *arenaSize(void *ptr)
+{
+    return (size_t *)((char *)ptr - ARENA_ALIGN);
+}
+
+/**
+ * Allocates 'size' bytes from 'arena', adding a block if there is no room.
+ */
+static void *arenaAlloc(struct arena *arena, size_t size)
+{
+    struct arenablock *block = arena->blocks;
+    size_t need = ARENA_ALIGN + ARENA_ROUND(size);
+    char *ptr;
+
+    if (!block || block->used + need > block->size) {
+        size_t blocksize = block ? block->size * 2 : ARENA_BLOCK_SIZE;
+
+        if (blocksize < need) {
+            blocksize = need;
+        }
+        block = (struct arenablock *)ln_malloc(ARENA_HEADER + blocksize);
+        block->next = arena->blocks;
+        block->size = blocksize;
+        block->used = 0;
+        arena->blocks = block;
+    }
+    ptr = arenaData(block) + block->used + ARENA_ALIGN;
+    *arenaSize(ptr) = size;
+    block->used += need;
+    return ptr;
+}
+
+/**
+ * Allocates, resizes or (if 'size' is 0) frees 'ptr' in the arena 'userdata',
+ * like realloc(). Freed memory is only reused if it was the latest allocation,
+ * which can also grow in place. Otherwise it is kept until arenaRelease().
+ *
+ * This is the sb_allocator reallocfn for stringbufs in the arena.
+ */
+static void *arenaRealloc(void *userdata, void *ptr, size_t size)
+{
+    struct arena *arena = (struct arena *)userdata;
+    struct arenablock *block = arena->blocks;
+    size_t oldsize;
+    size_t start;
+    void *newptr;
+
+    if (ptr == NULL) {
+        return size ? arenaAlloc(arena, size) : NULL;
+    }
+    oldsize = *arenaSize(ptr);
+    if (ptr == arenaData(block) + block->used - ARENA_ROUND(oldsize)) {
+        /* The latest allocation */
+        start = (char *)ptr - arenaData(block);
+        if (size == 0) {
+            block->used = start - ARENA_ALIGN;
+            return NULL;
+        }
+        if (start + ARENA_ROUND(size) <= block->size) {
+            block->used = start + ARENA_ROUND(size);
+            *arenaSize(ptr) = size;
+            return ptr;
+        }
+    }
+    if (size <= oldsize) {
+        return size ? ptr : NULL;
+    }
+    newptr = arenaAlloc(arena, size);
+    memcpy(newptr, ptr, oldsize);
+    return newptr;
+}
+
+/**
+ * Frees all the memory allocated from 'arena'.
+ */
+static void arenaRelease(struct arena *arena)
+{
+    while (arena->blocks) {
+        struct arenablock *next = arena->blocks->next;
+        ln_free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+/* Memory that is only used until the end of the edit */
+static void *tmp_realloc(struct current *current, void *ptr, size_t size)
+{
+    return arenaRealloc(&current->arena, ptr, size);
+}
+
+static void tmp_free(struct current *current, void *ptr)
+{
+    arenaRealloc(&current->arena, ptr, 0);
+}
+
+static stringbuf *tmp_sb_alloc(struct current *current)
+{
+    current->arena.alloc.reallocfn = arenaRealloc;
+    current->arena.alloc.userdata = &current->arena;
+    return sb_alloc_from(&current->arena.alloc);
+}
+
 static int fd_isatty(struct current *current)
 {
 #ifdef USE_TERMIOS
@@ -255,13 +669,154 @@ static int fd_isatty(struct current *current)
 
 void linenoiseHistoryFree(void) {
     if (history) {
-        int j;
-
-        for (j = 0; j < history_len; j++)
-            free(history[j]);
-        free(history);
+        ln_free(history);
+        ln_free(history_text);
+        ln_free(history_list);
         history = NULL;
+        history_text = NULL;
+        history_list = NULL;
         history_len = 0;
+        history_alloc = 0;
+        history_start = 0;
+        history_textlen = 0;
+        history_textalloc = 0;
+        history_dead = 0;
+    }
+}
+
+/**
+ * Copies 'len' bytes of 'line', and a null, to the end of history_text,
+ * making it larger if needed. 'line' may be part of history_text.
+ *
+ * Returns the offset of the copy, or -1 if no more memory could be allocated.
+ */
+static int history_store(const char *line, int len)
+{
+    int offset = history_textlen;
+    char *old = NULL;
+
+    if (offset + len + 1 > history_textalloc) {
+        int newalloc = history_textalloc ? history_textalloc * 2 : HISTORY_COMPACT_MIN;
+        char *text;
+
+        while (newalloc < offset + len + 1) {
+            newalloc *= 2;
+        }
+        text = (char *)ln_malloc(newalloc);
+        if (text == NULL) {
+            return -1;
+        }
+        if (history_textlen) {
+            memcpy(text, history_text, history_textlen);
+        }
+        /* Not freed until 'line' has been copied */
+        old = history_text;
+        history_text = text;
+        history_textalloc = newalloc;
+    }
+    memcpy(history_text + offset, line, len);
+    history_text[offset + len] = 0;
+    history_textlen += len + 1;
+    ln_free(old);
+    return offset;
+}
+
+/**
+ * Marks the text of 'slot' as no longer used.
+ */
+static void history_release(const struct historyslot *slot)
+{
+    if (slot->offset + slot->len + 1 == history_textlen) {
+        /* The last entry stored, e.g. the line being edited */
+        history_textlen = slot->offset;
+    }
+    else {
+        history_dead += slot->len + 1;
+    }
+}
+
+/**
+ * Copies the entries to a new block, in order and without the dead bytes
+ * between them, once enough of history_text is unused.
+ */
+static void history_compact(void)
+{
+    int live = history_textlen - history_dead;
+    int newalloc = HISTORY_COMPACT_MIN;
+    char *text;
+    int j;
+
+    if (history_dead < HISTORY_COMPACT_MIN || history_dead < live) {
+        return;
+    }
+    while (newalloc < live * 2) {
+        newalloc *= 2;
+    }
+    text = (char *)ln_malloc(newalloc);
+    if (text == NULL) {
+        /* Try again later */
+        return;
+    }
+    history_textlen = 0;
+    for (j = 0; j < history_len; j++) {
+        struct historyslot *slot = history_entry(j);
+
+        memcpy(text + history_textlen, history_text + slot->offset, slot->len + 1);
+        slot->offset = history_textlen;
+        history_textlen += slot->len + 1;
+    }
+    ln_free(history_text);
+    history_text = text;
+    history_textalloc = newalloc;
+    history_dead = 0;
+}
+
+/**
+ * Drops the oldest history entry.
+ */
+static void history_drop_first(void)
+{
+    history_release(history_entry(0));
+    history_start = (history_start + 1) % history_alloc;
+    history_len--;
+}
+
+/**
+ * Drops the newest history entry, the line that was being edited.
+ */
+static void history_drop_last(void)
+{
+    history_len--;
+    history_release(history_entry(history_len));
+}
+
+/**
+ * Replaces the text of history entry 'n' with 'line'.
+ */
+static void history_replace(int n, const char *line)
+{
+    struct historyslot *slot = history_entry(n);
+    int len = strlen(line);
+    char *str = history_text + slot->offset;
+
+    if (len <= slot->len) {
+        /* Fits where it is */
+        if (len < slot->len || memcmp(str, line, len) != 0) {
+            memcpy(str, line, len);
+            str[len] = 0;
+            history_dead += slot->len - len;
+            slot->len = len;
+        }
+    }
+    else {
+        int offset = history_store(line, len);
+
+        if (offset >= 0) {
+            history_release(slot);
+            slot->offset = offset;
+            slot->len = len;
+            history_compact();
+        }
     }
 }
 
@@ -394,10 +949,20 @@ static void DRL_STR(const char *str)
 
 #if defined(USE_TERMIOS)
 static void outputChars(struct current *current, const char *buf, int len);
+static int fd_write(int fd, const char *buf, int len);
 static void linenoiseAtExit(void);
+static void keytrieClear(void);
 static struct termios orig_termios; /* in order to restore at exit */
 static int rawmode = 0; /* for atexit() function to check if restore is needed*/
 static int atexit_registered = 0; /* register atexit just 1 time */
+static struct sigaction orig_winch; /* SIGWINCH action to restore with the terminal */
+static volatile sig_atomic_t window_changed = 1; /* set by SIGWINCH, so window_cols is stale */
+static int window_cols = 0; /* cached window width, valid while in raw mode and !window_changed */
+static struct inputbuf typeahead; /* input read by the last session but not used, for the next one */
+static int keeprawmode = 0; /* stay in raw mode between lines. See linenoiseSetKeepRawMode() */
+static struct linenoiseSession *session = NULL; /* the open session, if any */
+static int termchecked = 0; /* the terminal is known to be usable, and orig_termios is valid */
+static int escape_timeout = LINENOISE_DEFAULT_ESCAPE_TIMEOUT; /* how long to wait after ESC for the rest of a key */
 
 static const char *unsupported_term[] = {"dumb","cons25","emacs",NULL};
 
@@ -417,14 +982,35 @@ static int isUnsupportedTerm(void) {
     return 0;
 }
 
+/**
+ * Marks the cached window size as stale, then passes the signal
+ * on to whatever handler was installed before us.
+ */
+static void sigwinchHandler(int sig, siginfo_t *info, void *context)
+{
+    window_changed = 1;
+    if (orig_winch.sa_flags & SA_SIGINFO) {
+        orig_winch.sa_sigaction(sig, info, context);
+    }
+    else if (orig_winch.sa_handler != SIG_DFL && orig_winch.sa_handler != SIG_IGN) {
+        orig_winch.sa_handler(sig);
+    }
+}
+
 static int enableRawMode(struct current *current) {
     struct termios raw;
+    struct sigaction sa;
 
     current->fd = STDIN_FILENO;
     current->cols = 0;
 
-    if (!isatty(current->fd) || isUnsupportedTerm() ||
-        tcgetattr(current->fd, &orig_termios) == -1) {
+    if (rawmode) {
+        /* Still in raw mode since the last line */
+        goto ready;
+    }
+
+    if (!termchecked && (!isatty(current->fd) || isUnsupportedTerm() ||
+        tcgetattr(current->fd, &orig_termios) == -1)) {
 fatal:
         errno = ENOTTY;
         return -1;
@@ -472,138 +1058,523 @@ fatal:
         goto fatal;
     }
 
-    outputChars(current, "\x1b[g", -1);
+    /* Also turn on bracketed paste mode */
+    outputChars(current, "\x1b[g\x1b[?2004h", -1);
     rawmode = 1;
 
+    /* Cache the window size while in raw mode. The handler stays installed
+     * between lines if raw mode is kept, so use SA_RESTART to leave the
+     * application's own system calls alone. fd_fill() waits in poll(),
+     * which a resize interrupts anyway, so that the line can be redrawn at once.
+     */
+    window_changed = 1;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sa.sa_sigaction = sigwinchHandler;
+    sigaction(SIGWINCH, &sa, &orig_winch);
+
+ready:
+    /* Start with anything the last session read ahead */
+    current->input = typeahead;
+    typeahead.count = 0;
+
     current->cols = 0;
     return 0;
 }
 
 static void disableRawMode(struct current *current) {
+    if (!rawmode) {
+        return;
+    }
+    fd_write(current->fd, "\x1b[?2004l", 8);
+    /* Keep any input that was read ahead, such as the rest of a paste */
+    typeahead = current->input;
+    current->input.count = 0;
     /* Don't even check the return value as it's too late. */
-    if (rawmode && tcsetattr(current->fd,TCSADRAIN,&orig_termios) != -1)
+    if (tcsetattr(current->fd,TCSADRAIN,&orig_termios) != -1) {
+        sigaction(SIGWINCH, &orig_winch, NULL);
         rawmode = 0;
-}
-
-/* At exit we'll try to fix the terminal to the initial conditions. */
-static void linenoiseAtExit(void) {
-    if (rawmode) {
-        tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_termios);
     }
-    linenoiseHistoryFree();
 }
 
-/* gcc/glibc insists that we care about the return code of write!
- * Clarification: This means that a void-cast like "(void) (EXPR)"
- * does not work.
- */
-#define IGNORE_RC(EXPR) if (EXPR) {}
-
 /**
- * Output bytes directly, or accumulate output (if current->output is set)
+ * Called when a line is finished to leave raw mode, unless it is
+ * to be kept for the next line.
  */
-static void outputChars(struct current *current, const char *buf, int len)
+static void endRawMode(struct current *current)
 {
-    if (len < 0) {
-        len = strlen(buf);
-    }
-    if (current->output) {
-        sb_append_len(current->output, buf, len);
+    if (keeprawmode && rawmode) {
+        typeahead = current->input;
+        current->input.count = 0;
     }
     else {
-        IGNORE_RC(write(current->fd, buf, len));
+        disableRawMode(current);
     }
 }
 
-/* Like outputChars, but using printf-style formatting
+/**
+ * Leaves raw mode between lines, keeping any typeahead.
  */
-static void outputFormatted(struct current *current, const char *format, ...)
+static void restoreTerminal(void)
 {
-    va_list args;
-    char buf[64];
-    int n;
+    if (rawmode) {
+        struct current current;
 
-    va_start(args, format);
-    n = vsnprintf(buf, sizeof(buf), format, args);
-    /* This will never happen because we are sure to use outputFormatted() only for short sequences */
-    assert(n < (int)sizeof(buf));
-    va_end(args);
-    outputChars(current, buf, n);
+        memset(&current, 0, sizeof(current));
+        current.fd = STDIN_FILENO;
+        current.input = typeahead;
+        disableRawMode(&current);
+    }
 }
 
-static void cursorToLeft(struct current *current)
+void linenoiseSetKeepRawMode(int enable)
 {
-    outputChars(current, "\r", -1);
+    keeprawmode = enable;
+    if (!enable) {
+        restoreTerminal();
+    }
 }
 
-static void setOutputHighlight(struct current *current, const int *props, int nprops)
+/* A session, which keeps the terminal set up between lines */
+struct linenoiseSession {
+    int keeprawmode;    /* the setting to go back to on close */
+};
+
+struct linenoiseSession *linenoiseSessionOpen(void)
 {
-    outputChars(current, "\x1b[", -1);
-    while (nprops--) {
-        outputFormatted(current, "%d%c", *props, (nprops == 0) ? 'm' : ';');
-        props++;
+    struct current current;
+
+    if (session) {
+        errno = EBUSY;
+        return NULL;
     }
+    memset(&current, 0, sizeof(current));
+    if (enableRawMode(&current) == -1) {
+        return NULL;
+    }
+    session = (struct linenoiseSession *)ln_malloc(sizeof(*session));
+    session->keeprawmode = keeprawmode;
+    keeprawmode = 1;
+    termchecked = 1;
+    endRawMode(&current);
+    return session;
 }
 
-static void eraseEol(struct current *current)
+void linenoiseSessionSuspend(struct linenoiseSession *s)
 {
-    outputChars(current, "\x1b[0K", -1);
+    (void)s;
+    restoreTerminal();
 }
 
-static void setCursorPos(struct current *current, int x)
+void linenoiseSessionClose(struct linenoiseSession *s)
 {
-    if (x == 0) {
-        cursorToLeft(current);
-    }
-    else {
-        outputFormatted(current, "\r\x1b[%dC", x);
+    if (s) {
+        assert(s == session);
+        termchecked = 0;
+        session = NULL;
+        linenoiseSetKeepRawMode(s->keeprawmode);
+        ln_free(s);
     }
 }
 
-static void cursorUp(struct current *current, int n)
-{
-    if (n) {
-        outputFormatted(current, "\x1b[%dA", n);
+/* At exit we'll try to fix the terminal to the initial conditions. */
+static void linenoiseAtExit(void) {
+    if (rawmode) {
+        fd_write(STDIN_FILENO, "\x1b[?2004l", 8);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_termios);
     }
+    linenoiseHistoryFree();
+    keytrieClear();
 }
 
-static void cursorDown(struct current *current, int n)
+/**
+ * Writes all of the given pieces to 'fd', continuing after
+ * partial writes and interrupted system calls.
+ *
+ * Returns 0 if OK, or -1 on error.
+ */
+static int fd_writev(int fd, struct iovec *iov, int iovcnt)
 {
-    if (n) {
-        outputFormatted(current, "\x1b[%dB", n);
+    while (iovcnt) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd p;
+                p.fd = fd;
+                p.events = POLLOUT;
+                poll(&p, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        /* Skip over whatever was written */
+        while (iovcnt && n >= (ssize_t)iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int fd_write(int fd, const char *buf, int len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    return fd_writev(fd, &iov, 1);
+}
+
+/**
+ * Output bytes directly, or accumulate output (if current->output is set)
+ */
+static void outputChars(struct current *current, const char *buf, int len)
+{
+    if (len < 0) {
+        len = strlen(buf);
+    }
+    if (current->output) {
+        sb_append_len(current->output, buf, len);
+    }
+    else {
+        fd_write(current->fd, buf, len);
+    }
+}
+
+/**
+ * Like outputChars(), but while accumulating output the bytes are not copied.
+ * They must remain unchanged until refreshEnd().
+ */
+static void outputRef(struct current *current, const char *buf, int len)
+{
+    if (current->output && current->noutrefs < MAX_OUTPUT_REFS) {
+        struct outputref *ref = &current->outrefs[current->noutrefs++];
+        ref->offset = sb_len(current->output);
+        ref->data = buf;
+        ref->len = len;
+    }
+    else {
+        outputChars(current, buf, len);
+    }
+}
+
+/* ESC [ plus up to MAX_ATTR_PROPS + 1 numbers of at most 10 digits, each
+ * followed by ';' or the final byte
+ */
+#define MAX_CSI_LEN (2 + (MAX_ATTR_PROPS + 1) * 11)
+
+/* The two decimal digits of each number from 0 to 99 */
+static const char csi_digits[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* The most common sequences, already encoded */
+static const struct {
+    int arg;
+    char final;
+    const char *seq;
+} csi_common[] = {
+    { 0, 'm', "\x1b[0m" },
+    { 1, 'A', "\x1b[1A" },
+    { 1, 'B', "\x1b[1B" },
+};
+
+/**
+ * Encodes 'n' (or 0 if negative) in decimal at 'buf'.
+ * Returns the number of chars written, at most 10.
+ */
+static int encodeDecimal(char *buf, int n)
+{
+    char digits[10];
+    char *pt = digits + sizeof(digits);
+    int len;
+
+    if (n < 0) {
+        n = 0;
+    }
+    while (n >= 100) {
+        const char *d = csi_digits + (n % 100) * 2;
+        n /= 100;
+        *--pt = d[1];
+        *--pt = d[0];
+    }
+    if (n >= 10) {
+        *--pt = csi_digits[n * 2 + 1];
+        *--pt = csi_digits[n * 2];
+    }
+    else {
+        *--pt = '0' + n;
+    }
+    len = digits + sizeof(digits) - pt;
+    memcpy(buf, pt, len);
+    return len;
+}
+
+/**
+ * Encodes the control sequence ESC [ args final at 'buf', with the args separated by ';'.
+ * 'buf' must have room for MAX_CSI_LEN chars and nargs may be at most MAX_ATTR_PROPS + 1.
+ * Returns the number of chars written.
+ */
+static int encodeCSI(char *buf, const int *args, int nargs, char final)
+{
+    char *pt = buf;
+
+    *pt++ = '\x1b';
+    *pt++ = '[';
+    while (nargs--) {
+        pt += encodeDecimal(pt, *args++);
+        if (nargs) {
+            *pt++ = ';';
+        }
+    }
+    *pt++ = final;
+    return pt - buf;
+}
+
+/**
+ * Outputs the control sequence ESC [ args final without any formatting or allocation.
+ */
+static void outputCSI(struct current *current, const int *args, int nargs, char final)
+{
+    char buf[MAX_CSI_LEN];
+
+    if (nargs == 1) {
+        int i;
+        for (i = 0; i < (int)(sizeof(csi_common) / sizeof(*csi_common)); i++) {
+            if (csi_common[i].final == final && csi_common[i].arg == *args) {
+                outputChars(current, csi_common[i].seq, 4);
+                return;
+            }
+        }
+    }
+    outputChars(current, buf, encodeCSI(buf, args, nargs, final));
+}
+
+static void cursorToLeft(struct current *current)
+{
+    outputChars(current, "\r", -1);
+}
+
+static void setOutputHighlight(struct current *current, const int *props, int nprops)
+{
+    outputCSI(current, props, nprops, 'm');
+}
+
+static void eraseEol(struct current *current)
+{
+    outputChars(current, "\x1b[0K", -1);
+}
+
+static void insertChars(struct current *current, int n)
+{
+    outputCSI(current, &n, 1, '@');
+}
+
+static void deleteChars(struct current *current, int n)
+{
+    outputCSI(current, &n, 1, 'P');
+}
+
+static void setCursorPos(struct current *current, int x)
+{
+    if (x == 0) {
+        cursorToLeft(current);
+    }
+    else {
+        /* CR and the move together */
+        char buf[1 + MAX_CSI_LEN];
+        buf[0] = '\r';
+        outputChars(current, buf, 1 + encodeCSI(buf + 1, &x, 1, 'C'));
+    }
+}
+
+static void cursorUp(struct current *current, int n)
+{
+    if (n) {
+        outputCSI(current, &n, 1, 'A');
+    }
+}
+
+static void cursorDown(struct current *current, int n)
+{
+    if (n) {
+        outputCSI(current, &n, 1, 'B');
     }
 }
 
 void linenoiseClearScreen(void)
 {
-    IGNORE_RC(write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7));
+    fd_write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+}
+
+/**
+ * Returns 1 if there is input waiting to be used.
+ */
+static int fd_input_pending(struct current *current)
+{
+    struct pollfd p;
+
+    if (current->input.count) {
+        return 1;
+    }
+    p.fd = current->fd;
+    p.events = POLLIN;
+    return poll(&p, 1, 0) > 0;
+}
+
+/**
+ * Returns a monotonic time in milliseconds.
+ */
+static long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/**
+ * Called when the window may have been resized while waiting for a key.
+ * Redraws the line if the width has changed.
+ */
+static void refreshResized(struct current *current)
+{
+    int cols = current->cols;
+
+    getWindowSize(current);
+    if (current->cols != cols && current->screen.prompt) {
+        const char *buf = current->screen.buf;
+        if (buf) {
+            refreshLineAlt(current, current->screen.prompt, buf, current->screen.pos);
+        }
+        else {
+            refreshLineAlt(current, current->screen.prompt, NULL, current->pos);
+        }
+    }
 }
 
 /**
- * Reads a char from 'fd', waiting at most 'timeout' milliseconds.
+ * Reads whatever input is available into current->input with a single read(),
+ * first waiting at most 'timeout' milliseconds for some to arrive.
  *
- * A timeout of -1 means to wait forever.
+ * A timeout of -1 means to wait forever. If the window is resized in the
+ * meantime the line is redrawn first.
  *
- * Returns -1 if no char is received within the time or an error occurs.
+ * The last 'reserve' bytes of the ring are left unfilled.
+ *
+ * Returns 1 if input was added, 0 if none arrived in time or if the ring
+ * is full (nothing is read then), or -1 on EOF or error.
  */
-static int fd_read_char(int fd, int timeout)
+static int fd_fill(struct current *current, int timeout, int reserve)
 {
-    int rcode;
+    struct inputbuf *in = &current->input;
+    int tail = (in->head + in->count) % INPUT_BUF_SIZE;
+    int space = INPUT_BUF_SIZE - reserve - in->count;
     struct pollfd p;
-    unsigned char c;
+    int n;
 
-    p.fd = fd;
+    if (space <= 0) {
+        return 0;
+    }
+    if (tail + space > INPUT_BUF_SIZE) {
+        /* Only up to the end of the ring this time */
+        space = INPUT_BUF_SIZE - tail;
+    }
+    /* Wait in poll() rather than read(), since a signal interrupts poll()
+     * even with SA_RESTART. See enableRawMode().
+     */
+    p.fd = current->fd;
     p.events = POLLIN;
+    while ((n = poll(&p, 1, timeout)) < 0 && errno == EINTR) {
+        if (timeout < 0 && window_changed) {
+            refreshResized(current);
+        }
+    }
+    if (n <= 0) {
+        /* timeout or error */
+        return n;
+    }
+    while ((n = read(current->fd, in->data + tail, space)) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (n == 0) {
+        return -1;
+    }
+    in->count += n;
+    return 1;
+}
 
-    rcode = poll(&p, 1, timeout);
-    if (rcode <= 0) return -1;	/* timeout or interrupt */
+/**
+ * Returns the byte 'i' bytes after the next one. It must have been read.
+ */
+static int input_at(const struct inputbuf *in, int i)
+{
+    return in->data[(in->head + i) % INPUT_BUF_SIZE];
+}
 
-    if (read(fd, &c, 1) != 1) {
-        return -1;
+/**
+ * Returns the byte of input 'i' bytes after the next one without using it,
+ * waiting at most 'timeout' milliseconds (-1 for ever) if it has not arrived yet.
+ *
+ * Returns -1 if no byte is received within the time, or on EOF or error.
+ */
+static int input_peek(struct current *current, int i, int timeout)
+{
+    while (current->input.count <= i) {
+        if (fd_fill(current, timeout, INPUT_BUF_RESERVE) <= 0) {
+            return -1;
+        }
+    }
+    return input_at(&current->input, i);
+}
+
+/**
+ * Uses the next 'n' bytes of input, which must have been read.
+ */
+static void input_skip(struct current *current, int n)
+{
+    current->input.head = (current->input.head + n) % INPUT_BUF_SIZE;
+    current->input.count -= n;
+}
+
+/**
+ * Like input_peek() for the next byte, but uses it.
+ */
+static int input_next(struct current *current, int timeout)
+{
+    int c = input_peek(current, 0, timeout);
+
+    if (c >= 0) {
+        input_skip(current, 1);
     }
     return c;
 }
 
+/**
+ * Removes the 'len' bytes starting 'pos' bytes after the next one,
+ * leaving the bytes before and after them in place.
+ */
+static void input_remove(struct inputbuf *in, int pos, int len)
+{
+    while (pos--) {
+        in->data[(in->head + pos + len) % INPUT_BUF_SIZE] = in->data[(in->head + pos) % INPUT_BUF_SIZE];
+    }
+    in->head = (in->head + len) % INPUT_BUF_SIZE;
+    in->count -= len;
+}
+
 /**
  * Reads a complete utf-8 character
  * and returns the unicode value, or -1 on error.
@@ -616,25 +1587,47 @@ static int fd_read(struct current *current)
     int i;
     int c;
 
-    if (read(current->fd, &buf[0], 1) != 1) {
+    if ((c = input_next(current, -1)) < 0) {
         return -1;
     }
+    buf[0] = c;
     n = utf8_charlen(buf[0]);
     if (n < 1 || n > MAX_UTF8_LEN - 1) {
         return -1;
     }
     for (i = 1; i < n; i++) {
-        if (read(current->fd, &buf[i], 1) != 1) {
+        if ((c = input_next(current, -1)) < 0) {
             return -1;
         }
+        buf[i] = c;
     }
     buf[n] = 0;
     /* decode and return the character */
     utf8_tounicode(buf, &c);
     return c;
 #else
-    return fd_read_char(current->fd, -1);
+    return input_next(current, -1);
+#endif
+}
+
+/**
+ * Returns 1 if fd_read() can return a char without waiting, otherwise 0.
+ */
+static int fd_char_ready(struct current *current)
+{
+    int n = 1;
+
+#ifdef USE_UTF8
+    if (input_peek(current, 0, 0) < 0) {
+        return 0;
+    }
+    n = utf8_charlen(input_at(&current->input, 0));
+    if (n < 1 || n > MAX_UTF8_LEN - 1) {
+        /* fd_read() will report the error */
+        return 1;
+    }
 #endif
+    return input_peek(current, n - 1, 0) >= 0;
 }
 
 
@@ -644,8 +1637,8 @@ static int fd_read(struct current *current)
  */
 static int queryCursor(struct current *current, int* cols)
 {
-    struct esc_parser parser;
-    int ch;
+    struct inputbuf *in = &current->input;
+    int start = 0;
 
     /* Should not be buffering this output, it needs to go immediately */
     assert(current->output == NULL);
@@ -653,25 +1646,63 @@ static int queryCursor(struct current *current, int* cols)
     /* control sequence - report cursor location */
     outputChars(current, "\x1b[6n", -1);
 
-    /* Parse the response: ESC [ rows ; cols R */
-    initParseEscapeSeq(&parser, 'R');
-    while ((ch = fd_read_char(current->fd, 100)) > 0) {
-        switch (parseEscapeSequence(&parser, ch)) {
-            default:
-                continue;
-            case EP_END:
-                if (parser.numprops == 2 && parser.props[1] < 1000) {
-                    *cols = parser.props[1];
-                    return 1;
+    /* Look for the response: ESC [ rows ; cols R
+     * Anything else, such as keys typed in the meantime, is left in the input.
+     */
+    while (1) {
+        while (start < in->count) {
+            struct esc_parser parser;
+            int state = EP_START;
+            int i;
+
+            initParseEscapeSeq(&parser, 'R');
+            for (i = start; i < in->count; i++) {
+                state = parseEscapeSequence(&parser, input_at(in, i));
+                if (state == EP_END || state == EP_ERROR) {
+                    break;
                 }
+            }
+            if (state == EP_END && parser.numprops == 2 && parser.props[1] < 1000) {
+                *cols = parser.props[1];
+                input_remove(in, start, i + 1 - start);
+                return 1;
+            }
+            if (state != EP_END && state != EP_ERROR) {
+                /* Need more input */
                 break;
-            case EP_ERROR:
-                break;
+            }
+            start++;
+        }
+        /* The reply may use the reserved room if typeahead has filled the rest */
+        if (fd_fill(current, 100, 0) <= 0) {
+            /* failed */
+            return 0;
         }
-        /* failed */
-        break;
     }
-    return 0;
+}
+
+/**
+ * Returns the window width as reported by the tty, or 0 if unknown.
+ *
+ * While in raw mode the width is cached and the tty is only asked again
+ * after a SIGWINCH, so refreshing the line costs no extra system calls.
+ */
+static int getWindowCols(void)
+{
+    struct winsize ws;
+
+    if (rawmode && !window_changed) {
+        return window_cols;
+    }
+    /* Clear the flag first so that a resize during the ioctl is not lost */
+    window_changed = 0;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+        window_cols = ws.ws_col;
+    }
+    else {
+        window_cols = 0;
+    }
+    return window_cols;
 }
 
 /**
@@ -679,10 +1710,15 @@ static int queryCursor(struct current *current, int* cols)
  */
 static int getWindowSize(struct current *current)
 {
-    struct winsize ws;
+    int cols;
 
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col != 0) {
-        current->cols = ws.ws_col;
+    if (current->cols == 0) {
+        /* e.g. after ctrl-L, ask the tty again */
+        window_changed = 1;
+    }
+    cols = getWindowCols();
+    if (cols) {
+        current->cols = cols;
         return 0;
     }
 
@@ -728,97 +1764,393 @@ static int getWindowSize(struct current *current)
     return 0;
 }
 
+/* Key sequences known by default, without the initial ESC */
+static const struct {
+    const char *seq;
+    int key;
+} default_keys[] = {
+    { "[A", SPECIAL_UP },
+    { "[B", SPECIAL_DOWN },
+    { "[C", SPECIAL_RIGHT },
+    { "[D", SPECIAL_LEFT },
+    { "[F", SPECIAL_END },
+    { "[H", SPECIAL_HOME },
+    { "OA", SPECIAL_UP },
+    { "OB", SPECIAL_DOWN },
+    { "OC", SPECIAL_RIGHT },
+    { "OD", SPECIAL_LEFT },
+    { "OF", SPECIAL_END },
+    { "OH", SPECIAL_HOME },
+    { "[1~", SPECIAL_HOME },
+    { "[2~", SPECIAL_INSERT },
+    { "[3~", SPECIAL_DELETE },
+    { "[4~", SPECIAL_END },
+    { "[5~", SPECIAL_PAGE_UP },
+    { "[6~", SPECIAL_PAGE_DOWN },
+    { "[7~", SPECIAL_HOME },
+    { "[8~", SPECIAL_END },
+    { "[200~", SPECIAL_PASTE },
+};
+
+/* A node in the trie of key sequences. See decodeKey() */
+struct keynode {
+    int ch;                     /* the byte matched by this node */
+    int key;                    /* the key if a sequence ends here, or SPECIAL_NONE */
+    struct keynode *child;      /* first node for the following byte */
+    struct keynode *sibling;    /* next node for this byte */
+};
+
+/* The children of the root are the bytes that follow ESC */
+static struct keynode keyroot;
+static int keytrie_ready = 0;
+
+/* xterm modifier parameter, less one, e.g. \e[1;5C is ctrl-right */
+#define KEYMOD_SHIFT 1
+#define KEYMOD_ALT 2
+#define KEYMOD_CTRL 4
+
+/* Most bytes in a CSI sequence that are considered */
+#define MAX_KEY_SEQ 32
+
+static const struct keynode *keytrieChild(const struct keynode *node, int ch)
+{
+    for (node = node->child; node; node = node->sibling) {
+        if (node->ch == ch) {
+            break;
+        }
+    }
+    return node;
+}
+
 /**
- * If SPECIAL_ESCAPE was received, reads subsequent
- * chars to determine if this is a known special key.
- *
- * Returns SPECIAL_NONE if unrecognised, or -1 if EOF.
- *
- * If no additional char is received within a short time,
- * SPECIAL_ESCAPE is returned.
+ * Adds the sequence 'seq' (without ESC) for 'key', replacing any existing entry.
  */
-static int check_special(int fd)
+static void keytrieAdd(const char *seq, int key)
 {
-    int c = fd_read_char(fd, 50);
-    int c2;
+    struct keynode *node = &keyroot;
 
-    if (c < 0) {
-        return SPECIAL_ESCAPE;
-    }
-    else if (c >= 'a' && c <= 'z') {
-        /* esc-a => meta-a */
-        return meta(c);
-    }
+    for (; *seq; seq++) {
+        struct keynode **pp = &node->child;
 
-    c2 = fd_read_char(fd, 50);
-    if (c2 < 0) {
-        return c2;
-    }
-    if (c == '[' || c == 'O') {
-        /* Potential arrow key */
-        switch (c2) {
-            case 'A':
-                return SPECIAL_UP;
-            case 'B':
-                return SPECIAL_DOWN;
-            case 'C':
-                return SPECIAL_RIGHT;
-            case 'D':
-                return SPECIAL_LEFT;
-            case 'F':
-                return SPECIAL_END;
-            case 'H':
-                return SPECIAL_HOME;
-        }
-    }
-    if (c == '[' && c2 >= '1' && c2 <= '8') {
-        /* extended escape */
-        c = fd_read_char(fd, 50);
-        if (c == '~') {
-            switch (c2) {
-                case '2':
-                    return SPECIAL_INSERT;
-                case '3':
-                    return SPECIAL_DELETE;
-                case '5':
-                    return SPECIAL_PAGE_UP;
-                case '6':
-                    return SPECIAL_PAGE_DOWN;
-                case '7':
-                    return SPECIAL_HOME;
-                case '8':
-                    return SPECIAL_END;
-            }
+        while (*pp && (*pp)->ch != (unsigned char)*seq) {
+            pp = &(*pp)->sibling;
         }
-        while (c != -1 && c != '~') {
-            /* .e.g \e[12~ or '\e[11;2~   discard the complete sequence */
-            c = fd_read_char(fd, 50);
+        if (*pp == NULL) {
+            *pp = (struct keynode *)ln_calloc(sizeof(**pp));
+            (*pp)->ch = (unsigned char)*seq;
         }
+        node = *pp;
     }
+    node->key = key;
+}
 
-    return SPECIAL_NONE;
+/**
+ * Returns the key for the complete sequence 'seq' (without ESC), or SPECIAL_NONE.
+ */
+static int keytrieFind(const char *seq)
+{
+    const struct keynode *node = &keyroot;
+
+    for (; *seq && node; seq++) {
+        node = keytrieChild(node, (unsigned char)*seq);
+    }
+    return node ? node->key : SPECIAL_NONE;
 }
-#endif
 
-static void clearOutputHighlight(struct current *current)
+static void keytrieInit(void)
 {
-    int nohighlight = 0;
-    setOutputHighlight(current, &nohighlight, 1);
+    if (!keytrie_ready) {
+        int i;
+
+        keytrie_ready = 1;
+        for (i = 0; i < (int)(sizeof(default_keys) / sizeof(*default_keys)); i++) {
+            keytrieAdd(default_keys[i].seq, default_keys[i].key);
+        }
+    }
 }
 
-static void outputControlChar(struct current *current, char ch)
+static void keytrieFree(struct keynode *node)
 {
-    int reverse = 7;
-    setOutputHighlight(current, &reverse, 1);
-    outputChars(current, "^", 1);
-    outputChars(current, &ch, 1);
-    clearOutputHighlight(current);
+    while (node) {
+        struct keynode *next = node->sibling;
+        keytrieFree(node->child);
+        ln_free(node);
+        node = next;
+    }
 }
 
-#ifndef utf8_getchars
-static int utf8_getchars(char *buf, int c)
+static void keytrieClear(void)
 {
-#ifdef USE_UTF8
+    keytrieFree(keyroot.child);
+    keyroot.child = NULL;
+    keytrie_ready = 0;
+}
+
+/**
+ * Reads the rest of a CSI (ESC [) or SS3 (ESC O) sequence which is not in
+ * the trie, and returns the key it stands for, taking into account any
+ * xterm modifier. The intro byte has been peeked but not used.
+ *
+ * Returns SPECIAL_NONE if the key is unknown.
+ */
+static int decodeCSI(struct current *current, int intro)
+{
+    int params[2] = { 0, 0 };
+    int nparams = 0;
+    int other = 0;
+    int mods = 0;
+    int len = 1;
+    char seq[16];
+    int key;
+    int c;
+
+    /* Parameter and intermediate bytes, then the final byte */
+    while (1) {
+        c = input_peek(current, len, escape_timeout);
+        if (c < 0 || len == MAX_KEY_SEQ) {
+            /* Truncated */
+            input_skip(current, len);
+            return SPECIAL_NONE;
+        }
+        len++;
+        if (c >= '0' && c <= '9') {
+            if (nparams == 0) {
+                nparams = 1;
+            }
+            if (nparams <= 2 && params[nparams - 1] < 10000) {
+                params[nparams - 1] = params[nparams - 1] * 10 + c - '0';
+            }
+        }
+        else if (c == ';') {
+            nparams = (nparams ? nparams : 1) + 1;
+        }
+        else if (c >= 0x20 && c <= 0x3f) {
+            /* e.g. private parameters */
+            other = 1;
+        }
+        else {
+            break;
+        }
+    }
+    input_skip(current, len);
+    if (other || c < 0x40 || c > 0x7e) {
+        return SPECIAL_NONE;
+    }
+
+    /* Look up the sequence without the modifier.
+     * The modifier parameter is 1 + the modifier bits, and a missing
+     * (or 0) parameter means no modifier.
+     */
+    if (c == '~') {
+        snprintf(seq, sizeof(seq), "[%d~", params[0]);
+        if (nparams == 2 && params[1] > 1) {
+            mods = params[1] - 1;
+        }
+    }
+    else {
+        /* \e[1;5C, or \eO5C from older xterms */
+        int mod = nparams == 2 ? params[1] : params[0];
+
+        seq[0] = intro;
+        seq[1] = c;
+        seq[2] = 0;
+        if (mod > 1) {
+            mods = mod - 1;
+        }
+    }
+    key = keytrieFind(seq);
+
+    if (mods & (KEYMOD_ALT | KEYMOD_CTRL)) {
+        /* ctrl and alt arrows move by words */
+        if (key == SPECIAL_LEFT) {
+            key = meta('b');
+        }
+        else if (key == SPECIAL_RIGHT) {
+            key = meta('f');
+        }
+    }
+    return key;
+}
+
+/**
+ * If SPECIAL_ESCAPE was received, decodes the rest of the key sequence.
+ *
+ * Sequences in the trie (the defaults plus those added with
+ * linenoiseAddKeySequence()) are matched from the input that has arrived.
+ * Any other CSI or SS3 sequence is used up entirely.
+ *
+ * Returns the key, SPECIAL_NONE if unrecognised, or SPECIAL_ESCAPE if nothing
+ * follows the ESC within escape_timeout milliseconds.
+ */
+static int decodeKey(struct current *current)
+{
+    const struct keynode *node = &keyroot;
+    int matched = 0;
+    int key = SPECIAL_NONE;
+    int c;
+    int i;
+
+    keytrieInit();
+
+    /* Only a bare ESC needs to wait */
+    c = input_peek(current, 0, escape_timeout);
+    if (c < 0) {
+        return SPECIAL_ESCAPE;
+    }
+
+    /* Find the longest sequence in the trie */
+    for (i = 0; node->child; ) {
+        /* The rest of a sequence normally arrives with the start */
+        c = input_peek(current, i, escape_timeout);
+        if (c < 0 || (node = keytrieChild(node, c)) == NULL) {
+            break;
+        }
+        i++;
+        if (node->key) {
+            key = node->key;
+            matched = i;
+        }
+    }
+    if (matched) {
+        input_skip(current, matched);
+        return key;
+    }
+
+    c = input_at(&current->input, 0);
+    if (c == '[' || c == 'O') {
+        return decodeCSI(current, c);
+    }
+    input_skip(current, 1);
+    if ((c >= 'a' && c <= 'z') || c == '_') {
+        /* esc-a => meta-a */
+        return meta(c);
+    }
+    return SPECIAL_NONE;
+}
+
+/**
+ * Called in EDIT_PASTE mode to read the pasted text up to the end marker,
+ * ESC [ 2 0 1 ~, into current->paste, waiting at most 'timeout' milliseconds
+ * (-1 for ever) for each part of it. Line endings are stored as '\n'.
+ *
+ * Returns 1 at the end of the paste, 0 if the rest has not arrived yet,
+ * or -1 on EOF or error.
+ */
+static int readPaste(struct current *current, int timeout)
+{
+    char buf[256];
+    int len = 0;
+    int ret = -1;
+    int c;
+
+    while ((c = input_peek(current, 0, timeout)) >= 0) {
+        if (c == '\x1b') {
+            static const char end[] = "[201~";
+            int i = 0;
+            int next = 0;
+
+            while (end[i] && (next = input_peek(current, i + 1, timeout)) == end[i]) {
+                i++;
+            }
+            if (end[i] == 0) {
+                input_skip(current, i + 1);
+                ret = 1;
+                break;
+            }
+            if (next < 0 && timeout >= 0) {
+                /* Look at the ESC again when more has arrived */
+                break;
+            }
+        }
+        input_skip(current, 1);
+        if (c == '\n' && current->pasteprev == '\r') {
+            /* Already added for the CR */
+        }
+        else if (c) {
+            buf[len++] = (c == '\r') ? '\n' : c;
+            if (len == sizeof(buf)) {
+                sb_append_len(current->paste, buf, len);
+                len = 0;
+            }
+        }
+        current->pasteprev = c;
+    }
+    sb_append_len(current->paste, buf, len);
+    if (ret < 0 && timeout >= 0) {
+        /* Ran out of input for now */
+        ret = 0;
+    }
+    return ret;
+}
+
+/**
+ * Uses plain chars that have already arrived, up to about 'max' bytes, and
+ * copies them to 'buf', which must have room for MAX_UTF8_LEN more bytes than that.
+ * Stops at anything else, such as a control char, a char with a character
+ * callback or an incomplete utf-8 sequence.
+ *
+ * Returns the number of bytes copied.
+ */
+static int input_plain(struct current *current, char *buf, int max)
+{
+    const struct inputbuf *in = &current->input;
+    int len = 0;
+
+    while (len < max && len < in->count) {
+        int c = input_at(in, len);
+        int n = 1;
+        int i;
+
+        if (c < ' ' || c == 127) {
+            break;
+        }
+#ifdef USE_UTF8
+        if (c >= 0x80) {
+            char ch[MAX_UTF8_LEN];
+
+            n = utf8_charlen(c);
+            if (n < 1 || n > MAX_UTF8_LEN - 1 || len + n > in->count) {
+                break;
+            }
+            for (i = 0; i < n; i++) {
+                ch[i] = input_at(in, len + i);
+            }
+            ch[n] = 0;
+            utf8_tounicode(ch, &c);
+        }
+#endif
+        if (c < 256 && characterCallback[c]) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            buf[len + i] = input_at(in, len + i);
+        }
+        len += n;
+    }
+    input_skip(current, len);
+    return len;
+}
+
+int linenoiseAddKeySequence(const char *seq, int key)
+{
+    if (seq[0] != '\x1b' || seq[1] == 0) {
+        return -1;
+    }
+    keytrieInit();
+    keytrieAdd(seq + 1, key);
+    return 0;
+}
+
+void linenoiseSetEscapeTimeout(int ms)
+{
+    escape_timeout = ms;
+}
+#endif
+
+#ifndef utf8_getchars
+static int utf8_getchars(char *buf, int c)
+{
+#ifdef USE_UTF8
     return utf8_fromunicode(buf, c);
 #else
     *buf = c;
@@ -834,10 +2166,10 @@ static int utf8_getchars(char *buf, int c)
 static int get_char(struct current *current, int pos)
 {
     if (pos >= 0 && pos < sb_chars(current->buf)) {
-        int c;
-        int i = utf8_index(sb_str(current->buf), pos);
-        (void)utf8_tounicode(sb_str(current->buf) + i, &c);
-        return c;
+        sb_iter it;
+
+        sb_iter_init(&it, current->buf, pos);
+        return sb_iter_next(&it);
     }
     return -1;
 }
@@ -874,74 +2206,88 @@ static void beep(void) {
 static void freeCompletions(linenoiseCompletions *lc) {
     size_t i;
     for (i = 0; i < lc->len; i++)
-        free(lc->cvec[i]);
-    free(lc->cvec);
+        ln_free(lc->cvec[i]);
+    ln_free(lc->cvec);
 }
 
 
-/* This is an helper function for linenoiseEdit*() and is called when the
- * user types the <tab> key in order to complete the string currently in the
- * input.
- *
- * The state of the editing is encapsulated into the pointed linenoiseState
- * structure as described in the structure definition.
- *
- * If the function returns non-zero, the caller should handle the
- * returned value as a byte read from the standard input, and process
- * it as usually: this basically means that the function may return a byte
- * read from the termianl but not processed. Otherwise, if zero is returned,
- * the input was consumed by the completeLine() function to navigate the
- * possible completions, and the caller should read for the next characters
- * from stdin. */
-static int completeLine(struct current *current) {
-    linenoiseCompletions lc = { 0, NULL };
-    int c = 0;
+/**
+ * Shows the completion chosen, or the original line.
+ */
+static void completeShow(struct current *current)
+{
+    if (current->completion < current->completions.len) {
+        const char *str = current->completions.cvec[current->completion];
+        refreshLineAlt(current, current->prompt, str, utf8_strlen(str, -1));
+    } else {
+        refreshLine(current);
+    }
+}
 
-    completionCallback(sb_str(current->buf),&lc,completionUserdata);
-    if (lc.len == 0) {
+/**
+ * Called when the user types <tab> at the end of the line. If there are any
+ * completions of the line, the first is shown and EDIT_COMPLETE mode is entered
+ * to choose between them. See completeKey().
+ */
+static void completeStart(struct current *current)
+{
+    completionCallback(sb_str(current->buf), &current->completions, completionUserdata);
+    if (current->completions.len == 0) {
         beep();
-    } else {
-        size_t stop = 0, i = 0;
-
-        while(!stop) {
-            /* Show completion or original buffer */
-            if (i < lc.len) {
-                int chars = utf8_strlen(lc.cvec[i], -1);
-                refreshLineAlt(current, current->prompt, lc.cvec[i], chars);
-            } else {
-                refreshLine(current);
-            }
+        freeCompletions(&current->completions);
+        memset(&current->completions, 0, sizeof(current->completions));
+        return;
+    }
+    current->completion = 0;
+    current->mode = EDIT_COMPLETE;
+    completeShow(current);
+}
 
-            c = fd_read(current);
-            if (c == -1) {
-                break;
-            }
+/**
+ * Leaves EDIT_COMPLETE mode.
+ */
+static void completeEnd(struct current *current)
+{
+    /* A redraw after a resize must not refer to the freed completions */
+    current->screen.prompt = current->prompt;
+    current->screen.buf = NULL;
 
-            switch(c) {
-                case '\t': /* tab */
-                    i = (i+1) % (lc.len+1);
-                    if (i == lc.len) beep();
-                    break;
-                case SPECIAL_ESCAPE: /* escape */
-                    /* Re-show original buffer */
-                    if (i < lc.len) {
-                        refreshLine(current);
-                    }
-                    stop = 1;
-                    break;
-                default:
-                    /* Update buffer and return */
-                    if (i < lc.len) {
-                        set_current(current,lc.cvec[i]);
-                    }
-                    stop = 1;
-                    break;
+    freeCompletions(&current->completions);
+    memset(&current->completions, 0, sizeof(current->completions));
+    current->mode = EDIT_NORMAL;
+}
+
+/**
+ * Handles key 'c' in EDIT_COMPLETE mode. <tab> shows the next completion,
+ * and escape goes back to the original line. Any other key accepts the
+ * completion shown.
+ *
+ * Returns 0 if the key was used, otherwise the key, which should then be
+ * processed as usual.
+ */
+static int completeKey(struct current *current, int c)
+{
+    switch(c) {
+        case '\t': /* tab */
+            current->completion = (current->completion + 1) % (current->completions.len + 1);
+            if (current->completion == current->completions.len) beep();
+            completeShow(current);
+            return 0;
+        case SPECIAL_ESCAPE: /* escape */
+            /* Re-show original buffer */
+            if (current->completion < current->completions.len) {
+                refreshLine(current);
             }
-        }
+            break;
+        default:
+            /* Update buffer and return */
+            if (current->completion < current->completions.len) {
+                set_current(current, current->completions.cvec[current->completion]);
+            }
+            break;
     }
-
-    freeCompletions(&lc);
-    return c; /* Return last read character */
+    completeEnd(current);
+    return c;
 }
 
 /* Register a callback function to be called for tab-completion.
@@ -959,8 +2305,8 @@ linenoiseCompletionCallback * linenoiseSetCompletionCallback(linenoiseCompletion
  * user typed <tab>. See the example.c source code for a very easy to
  * understand example. */
 void linenoiseAddCompletion(linenoiseCompletions *lc, const char *str) {
-    lc->cvec = (char **)realloc(lc->cvec,sizeof(char*)*(lc->len+1));
-    lc->cvec[lc->len++] = strdup(str);
+    lc->cvec = (char **)ln_realloc(lc->cvec,sizeof(char*)*(lc->len+1));
+    lc->cvec[lc->len++] = ln_strdup(str);
 }
 
 /* Register a hits function to be called to show hits to the user at the
@@ -981,7 +2327,18 @@ void linenoiseSetFreeHintsCallback(linenoiseFreeHintsCallback *callback)
 #endif
 
 
-static const char *reduceSingleBuf(const char *buf, int availcols, int *cursor_pos)
+/**
+ * Returns the text of 'buf' from byte 'offset', or of current->buf if 'buf' is NULL.
+ *
+ * current->buf is read in place so that its gap stays where the last edit was
+ * made. The text may then end at the gap, so always read on from the next offset.
+ */
+static const char *bufText(struct current *current, const char *buf, int offset)
+{
+    return buf ? buf + offset : sb_part(current->buf, offset);
+}
+
+static int reduceSingleBuf(struct current *current, const char *buf, int availcols, int *cursor_pos)
 {
     /* We have availcols columns available.
      * If necessary, strip chars off the front of buf until *cursor_pos
@@ -990,14 +2347,16 @@ static const char *reduceSingleBuf(const char *buf, int availcols, int *cursor_p
     int needcols = 0;
     int pos = 0;
     int new_cursor_pos = *cursor_pos;
-    const char *pt = buf;
+    int start = 0;
+    int offset = 0;
+    const char *pt;
 
     DRL("reduceSingleBuf: availcols=%d, cursor_pos=%d\n", availcols, *cursor_pos);
 
-    while (*pt) {
+    while (*(pt = bufText(current, buf, offset))) {
         int ch;
         int n = utf8_tounicode(pt, &ch);
-        pt += n;
+        offset += n;
 
         needcols += char_display_width(ch);
 
@@ -1008,15 +2367,15 @@ static const char *reduceSingleBuf(const char *buf, int availcols, int *cursor_p
          * can't be used.
          */
         while (needcols >= availcols - 3) {
-            n = utf8_tounicode(buf, &ch);
-            buf += n;
+            n = utf8_tounicode(bufText(current, buf, start), &ch);
+            start += n;
             needcols -= char_display_width(ch);
             DRL_CHAR(ch);
 
             /* and adjust the apparent cursor position */
             new_cursor_pos--;
 
-            if (buf == pt) {
+            if (start == offset) {
                 /* can't remove more than this */
                 break;
             }
@@ -1028,70 +2387,26 @@ static const char *reduceSingleBuf(const char *buf, int availcols, int *cursor_p
 
     }
     DRL("<snip>");
-    DRL_STR(buf);
     DRL("\nafter reduce, needcols=%d, new_cursor_pos=%d\n", needcols, new_cursor_pos);
 
     /* Done, now new_cursor_pos contains the adjusted cursor position
-     * and buf points to he adjusted start
+     * and start is the byte offset of the adjusted start
      */
     *cursor_pos = new_cursor_pos;
-    return buf;
+    return start;
 }
 
 static int mlmode = 0;
+static int max_refresh_delay = LINENOISE_DEFAULT_MAX_REFRESH_DELAY;
 
 void linenoiseSetMultiLine(int enableml)
 {
     mlmode = enableml;
 }
 
-/* Helper of refreshSingleLine() and refreshMultiLine() to show hints
- * to the right of the prompt.
- * Returns 1 if a hint was shown, or 0 if not
- * If 'display' is 0, does no output. Just returns the appropriate return code.
- */
-static int refreshShowHints(struct current *current, const char *buf, int availcols, int display)
+void linenoiseSetMaxRefreshDelay(int ms)
 {
-    int rc = 0;
-    if (showhints && hintsCallback && availcols > 0) {
-        int bold = 0;
-        int color = -1;
-        char *hint = hintsCallback(buf, &color, &bold, hintsUserdata);
-        if (hint) {
-            rc = 1;
-            if (display) {
-                const char *pt;
-                if (bold == 1 && color == -1) color = 37;
-                if (bold || color > 0) {
-                    int props[3] = { bold, color, 49 }; /* bold, color, fgnormal */
-                    setOutputHighlight(current, props, 3);
-                }
-                DRL("<hint bold=%d,color=%d>", bold, color);
-                pt = hint;
-                while (*pt) {
-                    int ch;
-                    int n = utf8_tounicode(pt, &ch);
-                    int width = char_display_width(ch);
-
-                    if (width >= availcols) {
-                        DRL("<hinteol>");
-                        break;
-                    }
-                    DRL_CHAR(ch);
-
-                    availcols -= width;
-                    outputChars(current, pt, n);
-                    pt += n;
-                }
-                if (bold || color > 0) {
-                    clearOutputHighlight(current);
-                }
-                /* Call the function to free the hint returned. */
-                if (freeHintsCallback) freeHintsCallback(hint, hintsUserdata);
-            }
-        }
-    }
-    return rc;
+    max_refresh_delay = ms;
 }
 
 #ifdef USE_TERMIOS
@@ -1099,14 +2414,38 @@ static void refreshStart(struct current *current)
 {
     /* We accumulate all output here */
     assert(current->output == NULL);
-    current->output = sb_alloc();
+    if (current->outbuf) {
+        sb_clear(current->outbuf);
+    }
+    else {
+        current->outbuf = tmp_sb_alloc(current);
+    }
+    current->output = current->outbuf;
+    current->noutrefs = 0;
 }
 
 static void refreshEnd(struct current *current)
 {
-    /* Output everything at once */
-    IGNORE_RC(write(current->fd, sb_str(current->output), sb_len(current->output)));
-    sb_free(current->output);
+    struct iovec iov[MAX_OUTPUT_REFS * 2 + 1];
+    char *data = sb_len(current->output) ? sb_str(current->output) : (char *)"";
+    int pos = 0;
+    int n = 0;
+    int i;
+
+    /* Output everything at once, with the referenced pieces in place */
+    for (i = 0; i < current->noutrefs; i++) {
+        const struct outputref *ref = &current->outrefs[i];
+        iov[n].iov_base = data + pos;
+        iov[n++].iov_len = ref->offset - pos;
+        iov[n].iov_base = (void *)ref->data;
+        iov[n++].iov_len = ref->len;
+        pos = ref->offset;
+    }
+    iov[n].iov_base = data + pos;
+    iov[n++].iov_len = sb_len(current->output) - pos;
+    fd_writev(current->fd, iov, n);
+
+    current->noutrefs = 0;
     current->output = NULL;
 }
 
@@ -1127,70 +2466,603 @@ static void refreshEndChars(struct current *current)
 }
 #endif
 
-static void refreshLineAlt(struct current *current, const char *prompt, const char *buf, int cursor_pos)
+/* ============================= Screen model ===============================
+ *
+ * refreshLineAlt() remembers what it drew in current->screen: one cell per
+ * display column for each row of the prompt, buffer and hint, plus the
+ * cursor position and the attribute in effect on the terminal.
+ * Each refresh lays out the new frame one cell at a time and compares it
+ * against the model, so that only the cells that changed are output,
+ * followed by erasing whatever is left over from the previous frame and
+ * the final cursor move.
+ */
+
+/* Rather than move the cursor over this many unchanged cells, redraw them */
+#define MAX_REDRAW_GAP 4
+
+/**
+ * Discards the screen model, releasing its memory.
+ */
+static void screenFree(struct current *current)
 {
-    int i;
-    const char *pt;
-    int displaycol;
-    int displayrow;
-    int visible;
-    int currentpos;
-    int notecursor;
-    int cursorcol = 0;
-    int cursorrow = 0;
-    int hint;
-    struct esc_parser parser;
+    tmp_free(current, current->screen.cells);
+    tmp_free(current, current->screen.rowwidth);
+    tmp_free(current, current->screen.attrs);
+    memset(&current->screen, 0, sizeof(current->screen));
+}
 
-#ifdef DEBUG_REFRESHLINE
-    dfh = fopen("linenoise.debuglog", "a");
-#endif
+/**
+ * Call this when something other than refreshLineAlt() may have written to the terminal.
+ * The next refresh will erase every row that may have been used and redraw everything.
+ */
+static void screenInvalidate(struct current *current)
+{
+    current->screen.valid = 0;
+}
 
-    /* Should intercept SIGWINCH. For now, just get the size every time */
-    getWindowSize(current);
+/**
+ * Returns the index in the attribute table of the attribute made up
+ * of the given SGR properties, adding it if necessary.
+ */
+static int screenAttr(struct current *current, const int *props, int nprops)
+{
+    struct screen *s = &current->screen;
+    int i;
 
-    refreshStart(current);
+    for (i = 0; i < s->nattrs; i++) {
+        if (s->attrs[i].nprops == nprops && (nprops == 0 || memcmp(s->attrs[i].props, props, nprops * sizeof(*props)) == 0)) {
+            return i;
+        }
+    }
+    s->attrs = (struct attr *)tmp_realloc(current, s->attrs, sizeof(*s->attrs) * (s->nattrs + 1));
+    s->attrs[s->nattrs].nprops = nprops;
+    if (nprops) {
+        /* props may be NULL for the default attribute */
+        memcpy(s->attrs[s->nattrs].props, props, nprops * sizeof(*props));
+    }
+    return s->nattrs++;
+}
 
-    DRL("wincols=%d, cursor_pos=%d, nrows=%d, rpos=%d\n", current->cols, cursor_pos, current->nrows, current->rpos);
+static struct cell *screenCell(struct current *current, int row, int col)
+{
+    return &current->screen.cells[row * current->screen.cols + col];
+}
 
-    /* Here is the plan:
-     * (a) move the the bottom row, going down the appropriate number of lines
-     * (b) move to beginning of line and erase the current line
-     * (c) go up one line and do the same, until we have erased up to the first row
-     * (d) output the prompt, counting cols and rows, taking into account escape sequences
-     * (e) output the buffer, counting cols and rows
-     *   (e') when we hit the current pos, save the cursor position
-     * (f) move the cursor to the saved cursor position
-     * (g) save the current cursor row and number of rows
-     */
+/**
+ * Makes sure the model has room for at least 'rows' rows.
+ */
+static void screenEnsureRows(struct current *current, int rows)
+{
+    struct screen *s = &current->screen;
+
+    if (rows > s->rows) {
+        int newrows = rows * 2;
+        s->cells = (struct cell *)tmp_realloc(current, s->cells, sizeof(*s->cells) * newrows * s->cols);
+        s->rowwidth = (int *)tmp_realloc(current, s->rowwidth, sizeof(*s->rowwidth) * newrows);
+        memset(s->rowwidth + s->rows, 0, sizeof(*s->rowwidth) * (newrows - s->rows));
+        s->rows = newrows;
+    }
+}
 
-    /* (a) - The cursor is currently at row rpos */
-    cursorDown(current, current->nrows - current->rpos - 1);
-    DRL("<cud=%d>", current->nrows - current->rpos - 1);
+static void screenStartChars(struct current *current)
+{
+    if (!current->screen.inchars) {
+        refreshStartChars(current);
+        current->screen.inchars = 1;
+    }
+}
 
-    /* (b), (c) - Erase lines upwards until we get to the first row */
-    for (i = 0; i < current->nrows; i++) {
-        if (i) {
-            DRL("<cup>");
-            cursorUp(current, 1);
-        }
-        DRL("<clearline>");
-        cursorToLeft(current);
-        eraseEol(current);
+static void screenEndChars(struct current *current)
+{
+    if (current->screen.inchars) {
+        refreshEndChars(current);
+        current->screen.inchars = 0;
     }
-    DRL("\n");
+}
 
-    /* (d) First output the prompt. control sequences don't take up display space */
-    pt = prompt;
-    displaycol = 0; /* current display column */
-    displayrow = 0; /* current display row */
-    visible = 1;
+/**
+ * Outputs the SGR sequence to switch from attribute 'from' to attribute 'to'.
+ * If 'from' is a prefix of 'to', only the extra properties are output.
+ */
+static void outputAttr(struct current *current, int from, int to)
+{
+    const struct attr *fromattr = &current->screen.attrs[from];
+    const struct attr *toattr = &current->screen.attrs[to];
 
-    refreshStartChars(current);
+    if (fromattr->nprops < toattr->nprops &&
+        memcmp(fromattr->props, toattr->props, fromattr->nprops * sizeof(*fromattr->props)) == 0) {
+        setOutputHighlight(current, toattr->props + fromattr->nprops, toattr->nprops - fromattr->nprops);
+    }
+    else {
+        /* Need to reset first */
+        int props[MAX_ATTR_PROPS + 1];
+        props[0] = 0;
+        memcpy(props + 1, toattr->props, toattr->nprops * sizeof(*toattr->props));
+        setOutputHighlight(current, props, toattr->nprops + 1);
+    }
+}
 
-    while (*pt) {
-        int width;
-        int ch;
-        int n = utf8_tounicode(pt, &ch);
+/**
+ * Switches the terminal to the given attribute.
+ */
+static void screenSetAttr(struct current *current, int attr)
+{
+    struct screen *s = &current->screen;
+
+    if (attr == s->attr) {
+        return;
+    }
+    screenStartChars(current);
+    outputAttr(current, s->attr, attr);
+    s->attr = attr;
+}
+
+/**
+ * Moves the cursor to the given row and column.
+ * Rows that have never been used are created by outputting newlines.
+ */
+static void screenMove(struct current *current, int row, int col)
+{
+    struct screen *s = &current->screen;
+
+    if (row == current->rpos && col == s->col) {
+        return;
+    }
+    screenEndChars(current);
+
+    if (row < current->rpos) {
+        cursorUp(current, current->rpos - row);
+    }
+    else if (row > current->rpos) {
+        int lastrow = current->nrows - 1;
+        if (current->rpos < lastrow) {
+            cursorDown(current, (row < lastrow ? row : lastrow) - current->rpos);
+        }
+        if (row > lastrow) {
+            /* Can't move the cursor below the rows we have used since we may be
+             * at the bottom of the screen, so scroll with newlines
+             */
+            screenStartChars(current);
+            while (lastrow++ < row) {
+                refreshNewline(current);
+            }
+            screenEndChars(current);
+            current->nrows = row + 1;
+            s->col = 0;
+        }
+    }
+    current->rpos = row;
+
+    if (col != s->col) {
+        setCursorPos(current, col);
+        s->col = col;
+    }
+}
+
+/**
+ * Returns 1 if the cells from column 'from' up to 'to' on the given row
+ * are known and can simply be output again.
+ */
+static int screenCanRedraw(struct current *current, int row, int from, int to)
+{
+    if (to > current->screen.rowwidth[row]) {
+        return 0;
+    }
+    while (from < to) {
+        struct cell *cell = screenCell(current, row, from);
+        if (cell->width == 0 || cell->len == CELL_OVERFLOW) {
+            return 0;
+        }
+        from += cell->width;
+    }
+    return from == to;
+}
+
+/**
+ * Outputs the cell at the cursor position from the model
+ */
+static void screenRedrawCell(struct current *current)
+{
+    struct screen *s = &current->screen;
+    struct cell *cell = screenCell(current, current->rpos, s->col);
+
+    screenSetAttr(current, cell->attr);
+    screenStartChars(current);
+    if (cell->len) {
+        outputChars(current, cell->ch, cell->len);
+    }
+    else {
+        outputChars(current, " ", 1);
+    }
+    s->col += cell->width;
+}
+
+/**
+ * Records in the model that the given char is now displayed at row, col.
+ * The row must already exist in the model.
+ */
+static void screenPutCell(struct current *current, int row, int col, const char *bytes, int len, int width, int attr)
+{
+    struct screen *s = &current->screen;
+    struct cell *cell = screenCell(current, row, col);
+    int next = col + width;
+
+    if (col > 0 && col < s->rowwidth[row] && cell->width == 0) {
+        /* Overwrote the right half of a wide char, so the left half is gone too */
+        cell[-1].len = 0;
+        cell[-1].width = 1;
+        cell[-1].attr = 0;
+    }
+    while (s->rowwidth[row] < col) {
+        /* Should not happen as cells are drawn left to right, but be safe */
+        struct cell *blank = screenCell(current, row, s->rowwidth[row]++);
+        blank->len = 0;
+        blank->width = 1;
+        blank->attr = 0;
+    }
+    cell->attr = attr;
+    cell->width = width;
+    if (len <= CELL_BYTES) {
+        memcpy(cell->ch, bytes, len);
+        cell->len = len;
+    }
+    else {
+        cell->len = CELL_OVERFLOW;
+    }
+    if (width == 2) {
+        cell[1].attr = attr;
+        cell[1].width = 0;
+        cell[1].len = 0;
+    }
+    if (next < s->rowwidth[row] && cell[width].width == 0) {
+        /* Overwrote the left half of a wide char */
+        cell[width].len = 0;
+        cell[width].width = 1;
+        cell[width].attr = 0;
+    }
+    if (next > s->rowwidth[row]) {
+        s->rowwidth[row] = next;
+    }
+}
+
+/**
+ * Draws the given char (including any combining chars) with the given
+ * display width and attribute at row, col, unless it is already there.
+ */
+static void screenDrawCell(struct current *current, int row, int col, const char *bytes, int len, int width, int attr)
+{
+    struct screen *s = &current->screen;
+    struct cell *cell;
+
+    screenEnsureRows(current, row + 1);
+    cell = screenCell(current, row, col);
+
+    if (col < s->rowwidth[row] && cell->len == len && cell->width == width && cell->attr == attr &&
+        memcmp(cell->ch, bytes, len) == 0) {
+        /* Already on the terminal */
+        return;
+    }
+
+    if (row == current->rpos && col > s->col && col - s->col <= MAX_REDRAW_GAP &&
+        screenCanRedraw(current, row, s->col, col)) {
+        /* Cheaper to output the unchanged cells again than to move the cursor */
+        while (s->col < col) {
+            screenRedrawCell(current);
+        }
+    }
+    else {
+        screenMove(current, row, col);
+    }
+    screenSetAttr(current, attr);
+    screenStartChars(current);
+    outputChars(current, bytes, len);
+    s->col = col + width;
+    DRL("<draw %d,%d w=%d>", row, col, width);
+
+    screenPutCell(current, row, col, bytes, len, width, attr);
+}
+
+/**
+ * Erases anything on the given row beyond column 'width'
+ */
+static void screenEndRow(struct current *current, int row, int width)
+{
+    struct screen *s = &current->screen;
+
+    if (row < s->rows && s->rowwidth[row] > width) {
+        /* Don't erase with a background colour */
+        screenSetAttr(current, 0);
+        screenMove(current, row, width);
+        DRL("<erase %d,%d>", row, width);
+        eraseEol(current);
+        s->rowwidth[row] = width;
+    }
+}
+
+#ifdef USE_TERMIOS
+/**
+ * Inserts (n > 0) or deletes (n < 0) cells at row, col with ICH or DCH,
+ * moving the rest of the row along on both the terminal and in the model.
+ * 'col' must be the start of a char.
+ */
+static void screenShiftCells(struct current *current, int row, int col, int n)
+{
+    struct screen *s = &current->screen;
+    int width;
+    int i;
+
+    if (row >= s->rows || col >= s->rowwidth[row]) {
+        /* Nothing to move */
+        return;
+    }
+    width = s->rowwidth[row];
+
+    /* Blank cells take the current background */
+    screenSetAttr(current, 0);
+    screenMove(current, row, col);
+    DRL("<shift %d,%d n=%d>", row, col, n);
+    if (n > 0) {
+        insertChars(current, n);
+        width += n;
+        if (width > s->cols) {
+            /* Cells moved beyond the right margin are lost */
+            width = s->cols;
+        }
+        if (col + n < width) {
+            memmove(screenCell(current, row, col + n), screenCell(current, row, col),
+                sizeof(struct cell) * (width - col - n));
+        }
+        for (i = col; i < col + n && i < width; i++) {
+            struct cell *blank = screenCell(current, row, i);
+            blank->len = 0;
+            blank->width = 1;
+            blank->attr = 0;
+        }
+        if (screenCell(current, row, width - 1)->width == 2) {
+            /* The right half of a wide char was lost, so make sure the rest is drawn again */
+            screenCell(current, row, width - 1)->len = 0;
+            screenCell(current, row, width - 1)->width = 1;
+        }
+    }
+    else {
+        n = -n;
+        if (col + n > width) {
+            n = width - col;
+        }
+        deleteChars(current, n);
+        memmove(screenCell(current, row, col), screenCell(current, row, col + n),
+            sizeof(struct cell) * (width - col - n));
+        width -= n;
+    }
+    s->rowwidth[row] = width;
+}
+#endif
+
+/**
+ * Called at the start of each refresh.
+ * If the terminal no longer matches the model, erases all the rows we may have
+ * used, leaving the cursor at the start of the first row and the model empty.
+ */
+static void screenBegin(struct current *current)
+{
+    struct screen *s = &current->screen;
+    int i;
+
+    if (s->nattrs == 0) {
+        /* The default attribute is always index 0 */
+        screenAttr(current, NULL, 0);
+    }
+    if (s->valid && s->cols == current->cols) {
+        return;
+    }
+
+    /* The cursor is currently at row rpos. Move to the bottom row */
+    cursorDown(current, current->nrows - current->rpos - 1);
+    DRL("<cud=%d>", current->nrows - current->rpos - 1);
+
+    /* Erase lines upwards until we get to the first row */
+    for (i = 0; i < current->nrows; i++) {
+        if (i) {
+            DRL("<cup>");
+            cursorUp(current, 1);
+        }
+        DRL("<clearline>");
+        cursorToLeft(current);
+        eraseEol(current);
+    }
+    DRL("\n");
+    current->rpos = 0;
+
+    if (s->cols != current->cols) {
+        tmp_free(current, s->cells);
+        tmp_free(current, s->rowwidth);
+        s->cells = NULL;
+        s->rowwidth = NULL;
+        s->rows = 0;
+        s->cols = current->cols;
+    }
+    else if (s->rows) {
+        memset(s->rowwidth, 0, sizeof(*s->rowwidth) * s->rows);
+    }
+    s->col = 0;
+    s->attr = 0;
+    s->valid = 1;
+    s->haveprompt = 0;
+}
+
+/* The state of refreshLineAlt() while laying out a frame */
+struct layout {
+    int row;                    /* display row of the next cell */
+    int col;                    /* display column of the next cell */
+    int attr;                   /* attribute for the next cell */
+    int nprops;                 /* number of SGR properties making up attr */
+    int props[MAX_ATTR_PROPS];  /* ... and the properties */
+    /* The last char is held back until we know that no combining chars follow */
+    char pending[MAX_UTF8_LEN * 8];
+    int pendlen;                /* bytes in pending[], or 0 if none */
+    int pendwidth;              /* display width of the pending char */
+    int pendattr;               /* attribute of the pending char */
+    int pendcol;                /* display column of the pending char */
+    struct promptlayout *capture; /* if set, chars are recorded here rather than drawn */
+};
+
+/* One visible char of a compiled prompt */
+struct promptcell {
+    int row;
+    int col;
+    int width;
+    int attr;
+    int offset;                 /* offset of the char (plus any combining chars) in promptlayout.bytes */
+    int len;                    /* ... and the number of bytes */
+};
+
+/* current->prompt is laid out once per call to linenoise() (and again if the
+ * window width changes) rather than parsed on every refresh.
+ */
+struct promptlayout {
+    int cols;                   /* window width used for the layout, or 0 if none yet */
+    struct promptcell *cells;   /* the visible chars of the prompt */
+    int ncells;
+    int alloc;                  /* number of entries allocated in cells[] */
+    stringbuf *bytes;           /* utf-8 bytes of all cells */
+    int *rowwidth;              /* display width of each row before end.row */
+    stringbuf *image;           /* output that draws the prompt on an empty screen, or NULL */
+    struct layout end;          /* layout state after the prompt */
+};
+
+/**
+ * Applies the given SGR properties to the attribute for subsequent cells.
+ */
+static void layoutProps(struct current *current, struct layout *lay, const int *props, int nprops)
+{
+    while (nprops--) {
+        if (*props == 0) {
+            lay->nprops = 0;
+        }
+        else {
+            if (lay->nprops == MAX_ATTR_PROPS) {
+                /* Too many. Discard the oldest */
+                memmove(lay->props, lay->props + 1, sizeof(*lay->props) * (MAX_ATTR_PROPS - 1));
+                lay->nprops--;
+            }
+            lay->props[lay->nprops++] = *props;
+        }
+        props++;
+    }
+    lay->attr = screenAttr(current, lay->props, lay->nprops);
+}
+
+/**
+ * Draws the pending char, if any
+ */
+static void layoutFlush(struct current *current, struct layout *lay)
+{
+    if (lay->pendlen) {
+        if (lay->capture) {
+            struct promptlayout *pl = lay->capture;
+            struct promptcell *pc;
+
+            if (pl->ncells == pl->alloc) {
+                pl->alloc = pl->alloc ? pl->alloc * 2 : 32;
+                pl->cells = (struct promptcell *)tmp_realloc(current, pl->cells, sizeof(*pl->cells) * pl->alloc);
+            }
+            pc = &pl->cells[pl->ncells++];
+            pc->row = lay->row;
+            pc->col = lay->pendcol;
+            pc->width = lay->pendwidth;
+            pc->attr = lay->pendattr;
+            pc->offset = sb_len(pl->bytes);
+            pc->len = lay->pendlen;
+            sb_append_len(pl->bytes, lay->pending, lay->pendlen);
+        }
+        else {
+            screenDrawCell(current, lay->row, lay->pendcol, lay->pending, lay->pendlen, lay->pendwidth, lay->pendattr);
+        }
+        lay->pendlen = 0;
+    }
+}
+
+/**
+ * Adds a char of the given display width at the next position.
+ * Zero width (combining) chars are added to the previous char.
+ */
+static void layoutChar(struct current *current, struct layout *lay, const char *bytes, int len, int width)
+{
+    if (width == 0) {
+        if (lay->pendlen && lay->pendlen + len <= (int)sizeof(lay->pending)) {
+            memcpy(lay->pending + lay->pendlen, bytes, len);
+            lay->pendlen += len;
+        }
+        return;
+    }
+    layoutFlush(current, lay);
+    memcpy(lay->pending, bytes, len);
+    lay->pendlen = len;
+    lay->pendwidth = width;
+    lay->pendattr = lay->attr;
+    lay->pendcol = lay->col;
+    lay->col += width;
+}
+
+/**
+ * Adds a char from the buffer (or hint), which has already been
+ * determined to take 'width' columns.
+ * Control chars are shown as ^X in reverse video and tabs as spaces.
+ */
+static void layoutDisplayChar(struct current *current, struct layout *lay, const char *bytes, int len, int ch, int width)
+{
+    if (ch == '\t') {
+        while (width--) {
+            layoutChar(current, lay, " ", 1, 1);
+        }
+    }
+    else if (ch < ' ') {
+        int reverse = 7;
+        int normal = 0;
+        char ctrlch = ch + '@';
+
+        layoutProps(current, lay, &reverse, 1);
+        layoutChar(current, lay, "^", 1, 1);
+        layoutChar(current, lay, &ctrlch, 1, 1);
+        layoutProps(current, lay, &normal, 1);
+    }
+    else {
+        layoutChar(current, lay, bytes, len, width);
+    }
+}
+
+/**
+ * Ends the current row and moves to the start of the next one
+ */
+static void layoutNewline(struct current *current, struct layout *lay)
+{
+    layoutFlush(current, lay);
+    if (lay->capture) {
+        lay->capture->rowwidth = (int *)tmp_realloc(current, lay->capture->rowwidth, sizeof(int) * (lay->row + 1));
+        lay->capture->rowwidth[lay->row] = lay->col;
+    }
+    else {
+        screenEndRow(current, lay->row, lay->col);
+    }
+    lay->row++;
+    lay->col = 0;
+    DRL("<nl>");
+}
+
+/**
+ * Lays out the prompt. Escape sequences don't take up display space,
+ * but SGR sequences set the attribute of the following chars.
+ */
+static void layoutPrompt(struct current *current, struct layout *lay, const char *prompt)
+{
+    const char *pt = prompt;
+    int visible = 1;
+    struct esc_parser parser;
+
+    while (*pt) {
+        int width;
+        int ch;
+        int n = utf8_tounicode(pt, &ch);
 
         if (visible && ch == SPECIAL_ESCAPE) {
             /* The start of an escape sequence, so not visible */
@@ -1201,31 +3073,20 @@ static void refreshLineAlt(struct current *current, const char *prompt, const ch
 
         if (ch == '\n' || ch == '\r') {
             /* treat both CR and NL the same and force wrap */
-            refreshNewline(current);
-            displaycol = 0;
-            displayrow++;
+            layoutNewline(current, lay);
         }
-        else {
-            width = visible * utf8_width(ch);
+        else if (visible) {
+            width = utf8_width(ch);
 
-            displaycol += width;
-            if (displaycol >= current->cols) {
-                /* need to wrap to the next line because of newline or if it doesn't fit
+            if (lay->col + width >= current->cols) {
+                /* need to wrap to the next line because it doesn't fit
                  * XXX this is a problem in single line mode
                  */
-                refreshNewline(current);
-                displaycol = width;
-                displayrow++;
+                layoutNewline(current, lay);
             }
 
             DRL_CHAR(ch);
-#ifdef USE_WINCONSOLE
-            if (visible) {
-                outputChars(current, pt, n);
-            }
-#else
-            outputChars(current, pt, n);
-#endif
+            layoutChar(current, lay, pt, n, width);
         }
         pt += n;
 
@@ -1233,7 +3094,7 @@ static void refreshLineAlt(struct current *current, const char *prompt, const ch
             switch (parseEscapeSequence(&parser, ch)) {
                 case EP_END:
                     visible = 1;
-                    setOutputHighlight(current, parser.props, parser.numprops);
+                    layoutProps(current, lay, parser.props, parser.numprops);
                     DRL("<esc-seq-end,numprops=%d>", parser.numprops);
                     break;
                 case EP_ERROR:
@@ -1243,243 +3104,864 @@ static void refreshLineAlt(struct current *current, const char *prompt, const ch
             }
         }
     }
+}
+
+/**
+ * Discards the compiled prompt, releasing its memory.
+ */
+static void promptlayoutFree(struct current *current)
+{
+    struct promptlayout *pl = current->promptlayout;
+
+    if (pl) {
+        tmp_free(current, pl->cells);
+        tmp_free(current, pl->rowwidth);
+        sb_free(pl->bytes);
+        sb_free(pl->image);
+        tmp_free(current, pl);
+        current->promptlayout = NULL;
+    }
+}
+
+/**
+ * Lays out current->prompt for the current window width, unless already done.
+ */
+static struct promptlayout *compilePrompt(struct current *current)
+{
+    struct promptlayout *pl = current->promptlayout;
+
+    if (pl && pl->cols == current->cols) {
+        return pl;
+    }
+    promptlayoutFree(current);
+    pl = (struct promptlayout *)memset(tmp_realloc(current, NULL, sizeof(*pl)), 0, sizeof(*pl));
+    pl->cols = current->cols;
+    pl->bytes = tmp_sb_alloc(current);
+    pl->end.capture = pl;
+    layoutPrompt(current, &pl->end, current->prompt);
+    layoutFlush(current, &pl->end);
+    pl->end.capture = NULL;
+    current->promptlayout = pl;
+
+#ifdef USE_TERMIOS
+    if (pl->ncells) {
+        /* Render the prompt as it would be drawn on an empty screen, starting at
+         * the top left with the default attribute, so that it can be output at once.
+         */
+        stringbuf *output = current->output;
+        int row = 0;
+        int attr = 0;
+        int i;
+
+        current->output = pl->image = tmp_sb_alloc(current);
+        for (i = 0; i < pl->ncells; i++) {
+            const struct promptcell *pc = &pl->cells[i];
+            for (; row < pc->row; row++) {
+                outputChars(current, "\n", 1);
+            }
+            if (pc->attr != attr) {
+                outputAttr(current, attr, pc->attr);
+                attr = pc->attr;
+            }
+            outputChars(current, sb_str(pl->bytes) + pc->offset, pc->len);
+        }
+        current->output = output;
+    }
+#endif
+    return pl;
+}
+
+/**
+ * Draws current->prompt from its compiled form, unless it is already on the terminal,
+ * and sets up 'lay' to follow it.
+ * If 'redraw' is set, the screen model has just been emptied.
+ */
+static void refreshPrompt(struct current *current, struct layout *lay, int redraw)
+{
+    struct screen *s = &current->screen;
+    struct promptlayout *pl = compilePrompt(current);
+    int i;
+
+    if (s->haveprompt) {
+        /* Nothing to do */
+    }
+    else if (redraw && pl->image) {
+        /* Output the pre-rendered prompt, then update the model to match */
+        const struct promptcell *last = &pl->cells[pl->ncells - 1];
+
+        screenStartChars(current);
+        outputRef(current, sb_str(pl->image), sb_len(pl->image));
+        screenEnsureRows(current, last->row + 1);
+        for (i = 0; i < pl->ncells; i++) {
+            const struct promptcell *pc = &pl->cells[i];
+            screenPutCell(current, pc->row, pc->col, sb_str(pl->bytes) + pc->offset, pc->len, pc->width, pc->attr);
+        }
+        current->rpos = last->row;
+        if (current->nrows <= last->row) {
+            current->nrows = last->row + 1;
+        }
+        s->col = last->col + last->width;
+        s->attr = last->attr;
+    }
+    else {
+        int row = 0;
+
+        for (i = 0; i < pl->ncells; i++) {
+            const struct promptcell *pc = &pl->cells[i];
+            for (; row < pc->row; row++) {
+                screenEndRow(current, row, pl->rowwidth[row]);
+            }
+            screenDrawCell(current, pc->row, pc->col, sb_str(pl->bytes) + pc->offset, pc->len, pc->width, pc->attr);
+        }
+        for (; row < pl->end.row; row++) {
+            screenEndRow(current, row, pl->rowwidth[row]);
+        }
+    }
+    *lay = pl->end;
+    s->haveprompt = 1;
+}
+
+/**
+ * Discards the layout cache, releasing its memory.
+ */
+static void linecacheFree(struct current *current)
+{
+    tmp_free(current, current->linecache.prompt);
+    tmp_free(current, current->linecache.chars);
+    memset(&current->linecache, 0, sizeof(current->linecache));
+}
+
+/**
+ * Call this when the buffer is changed at char 'pos'.
+ * The layout of the chars before 'pos' remains valid.
+ */
+static void linecacheInvalidate(struct current *current, int pos)
+{
+    if (current->linecache.valid > pos) {
+        current->linecache.valid = pos;
+    }
+    current->linecache.shown = 0;
+    current->linecache.shift = 0;
+}
+
+/**
+ * Called by insert_char() and remove_char() when the terminal showed the
+ * buffer just before char 'pos' was inserted ('ch') or removed (ch < 0).
+ *
+ * In single line mode, notes how the rest of the row must move so that the
+ * next refresh can move it with ICH or DCH rather than draw it all again.
+ * Any further edit before that refresh cancels this.
+ */
+static void linecacheShift(struct current *current, int pos, int ch)
+{
+#ifdef USE_TERMIOS
+    struct linecache *lc = &current->linecache;
+
+    if (!mlmode && lc->first == 0 && pos < lc->nchars && current->screen.prompt == current->prompt) {
+        const struct charpos *cp = &lc->chars[pos];
+        sb_iter it;
+        int c;
+
+        /* A tab in the rest of the row would not move, but change width.
+         * Look with an iterator, since sb_str() would close the gap at the edit.
+         */
+        sb_iter_init(&it, current->buf, ch < 0 ? pos : pos + 1);
+        while ((c = sb_iter_next(&it)) >= 0) {
+            if (c == '\t') {
+                return;
+            }
+        }
+
+        if (ch < 0) {
+            lc->shift = -cp->width;
+        }
+        else if (ch == '\t') {
+            lc->shift = TAB_WIDTH - (cp->col % TAB_WIDTH);
+        }
+        else {
+            /* Zero for a combining char, which moves nothing */
+            lc->shift = char_display_width(ch);
+        }
+        lc->shiftrow = cp->row;
+        lc->shiftcol = cp->col;
+    }
+#else
+    (void)current;
+    (void)pos;
+    (void)ch;
+#endif
+}
+
+/**
+ * Prepares to lay out current->buf after 'prompt' in multiline mode.
+ *
+ * If the terminal still shows the last frame and the start of the buffer is
+ * unchanged, sets up 'lay' as it was just before the first char that needs to
+ * be laid out again and returns the index of that char.
+ * Otherwise returns 0 and everything must be laid out from the start.
+ */
+static int linecacheResume(struct current *current, const char *prompt, struct layout *lay, int redraw)
+{
+    struct linecache *lc = &current->linecache;
+    const struct charpos *cp;
+    const struct attr *attr;
+    int pos = lc->valid - 1;
+
+    if (redraw || lc->cols != current->cols || !lc->prompt || strcmp(lc->prompt, prompt) != 0) {
+        tmp_free(current, lc->prompt);
+        lc->prompt = (char *)memcpy(tmp_realloc(current, NULL, strlen(prompt) + 1), prompt, strlen(prompt) + 1);
+        lc->cols = current->cols;
+        lc->valid = 0;
+        return 0;
+    }
+    /* Lay out at least the last valid char again, since it may be followed
+     * by a new combining char, and never resume at a combining char.
+     */
+    while (pos > 0 && lc->chars[pos].width == 0) {
+        pos--;
+    }
+    if (pos <= 0) {
+        return 0;
+    }
+
+    cp = &lc->chars[pos - 1];
+    lay->row = cp->row;
+    lay->col = cp->col + cp->width;
+    lay->attr = cp->attr;
+    attr = &current->screen.attrs[cp->attr];
+    lay->nprops = attr->nprops;
+    memcpy(lay->props, attr->props, sizeof(*attr->props) * attr->nprops);
+    return pos;
+}
+
+/**
+ * Records the position of char 'pos' of the buffer, which has just been laid out.
+ */
+static void linecacheAdd(struct current *current, int pos, int offset, int row, int col, const struct layout *lay)
+{
+    struct linecache *lc = &current->linecache;
+    struct charpos *cp;
+
+    if (pos >= lc->alloc) {
+        lc->alloc = lc->alloc ? lc->alloc * 2 : 64;
+        lc->chars = (struct charpos *)tmp_realloc(current, lc->chars, sizeof(*lc->chars) * lc->alloc);
+    }
+    cp = &lc->chars[pos];
+    cp->offset = offset;
+    cp->row = row;
+    cp->col = col;
+    cp->width = lay->col - col;
+    cp->attr = lay->attr;
+}
+
+/**
+ * Passes the cached hint, if any, to freeHintsCallback.
+ */
+static void hintcacheFree(struct current *current)
+{
+    struct hintcache *hc = &current->hintcache;
+
+    if (hc->hint && freeHintsCallback) {
+        freeHintsCallback(hc->hint, hc->userdata);
+    }
+    memset(hc, 0, sizeof(*hc));
+}
+
+/**
+ * Returns the hint for 'buf' (current->buf if NULL), calling hintsCallback only
+ * if this is not current->buf as it was for the last call. The hint remains
+ * owned by the cache, which frees it once it is replaced.
+ */
+static const char *getHint(struct current *current, const char *buf, int *color, int *bold)
+{
+    struct hintcache *hc = &current->hintcache;
+    int usecache = buf == NULL;
+
+    if (!usecache || !hc->valid || hc->revision != sb_revision(current->buf) ||
+        hc->callback != hintsCallback || hc->userdata != hintsUserdata) {
+        hintcacheFree(current);
+        hc->color = -1;
+        /* The callback needs the line in one piece */
+        hc->hint = hintsCallback(usecache ? sb_str(current->buf) : buf, &hc->color, &hc->bold, hintsUserdata);
+        hc->callback = hintsCallback;
+        hc->userdata = hintsUserdata;
+        hc->revision = sb_revision(current->buf);
+        hc->valid = usecache;
+    }
+    *color = hc->color;
+    *bold = hc->bold;
+    return hc->hint;
+}
+
+/* Helper of refreshLineAlt() to show hints to the right of the buffer.
+ */
+static void refreshShowHints(struct current *current, struct layout *lay, const char *buf)
+{
+    int availcols = current->cols - lay->col;
+
+    if (showhints && hintsCallback && availcols > 0) {
+        int bold;
+        int color;
+        const char *hint = getHint(current, buf, &color, &bold);
+        if (hint) {
+            const char *pt;
+            if (bold == 1 && color == -1) color = 37;
+            if (bold || color > 0) {
+                int props[3] = { bold, color, 49 }; /* bold, color, fgnormal */
+                layoutProps(current, lay, props, 3);
+            }
+            DRL("<hint bold=%d,color=%d>", bold, color);
+            pt = hint;
+            while (*pt) {
+                int ch;
+                int n = utf8_tounicode(pt, &ch);
+                int width = char_display_width(ch);
+
+                if (width >= availcols) {
+                    DRL("<hinteol>");
+                    break;
+                }
+                DRL_CHAR(ch);
+
+                availcols -= width;
+                layoutDisplayChar(current, lay, pt, n, ch, width);
+                pt += n;
+            }
+            if (bold || color > 0) {
+                int normal = 0;
+                layoutProps(current, lay, &normal, 1);
+            }
+        }
+    }
+}
+
+/**
+ * Draws 'prompt' followed by 'buf' with the cursor at char 'cursor_pos'.
+ * If 'buf' is NULL, current->buf is drawn, without closing its gap.
+ */
+static void refreshLineAlt(struct current *current, const char *prompt, const char *buf, int cursor_pos)
+{
+    int row;
+    const char *pt;
+    int offset;
+    int currentpos;
+    int notecursor;
+    int cursorcol = 0;
+    int cursorrow = 0;
+    int redraw;
+    int usecache;
+    int fitcols = 0;
+    int maxcursor = -1;
+    int first = 0;
+    struct layout lay;
 
-    /* Now we are at the first line with all lines erased */
-    DRL("\nafter prompt: displaycol=%d, displayrow=%d\n", displaycol, displayrow);
+#ifdef DEBUG_REFRESHLINE
+    dfh = fopen("linenoise.debuglog", "a");
+#endif
 
+    current->refreshpending = 0;
 
-    /* (e) output the buffer, counting cols and rows */
+    /* Cheap unless SIGWINCH was received. See getWindowCols() */
+    getWindowSize(current);
+
+    /* Remember what is being drawn in case it must be redrawn after a resize */
+    current->screen.prompt = prompt;
+    current->screen.buf = buf;
+    current->screen.pos = cursor_pos;
+
+    refreshStart(current);
+
+    DRL("wincols=%d, cursor_pos=%d, nrows=%d, rpos=%d\n", current->cols, cursor_pos, current->nrows, current->rpos);
+
+    /* Here is the plan:
+     * (a) if the terminal doesn't match the screen model, erase all the rows
+     *     we have used and start again with an empty model
+     * (b) lay out the prompt, counting cols and rows, taking into account escape sequences
+     * (c) lay out the buffer, counting cols and rows
+     *   (c') when we hit the current pos, save the cursor position
+     * (d) lay out the hints
+     *   Each cell is compared against the screen model as it is laid out
+     *   and only cells that differ are output.
+     * (e) erase anything left over from the previous frame
+     * (f) move the cursor to the saved cursor position
+     */
+
+    /* (a) */
+    redraw = !current->screen.valid || current->screen.cols != current->cols;
+    screenBegin(current);
+
+    /* In multiline mode, the layout of the unchanged start of the buffer
+     * can be taken from the last refresh, if that showed the same buffer.
+     */
+    memset(&lay, 0, sizeof(lay));
+    usecache = buf == NULL;
+    currentpos = 0;
+    if (!mlmode) {
+        /* The line may have scrolled, so lay it out from the start */
+        current->linecache.valid = 0;
+    }
+    if (usecache) {
+        currentpos = linecacheResume(current, prompt, &lay, redraw);
+    }
+    else {
+        current->linecache.valid = 0;
+        current->linecache.shown = 0;
+    }
+
+    /* (b) First lay out the prompt */
+    if (currentpos) {
+        /* Already on the terminal */
+    }
+    else if (prompt == current->prompt) {
+        refreshPrompt(current, &lay, redraw);
+    }
+    else {
+        layoutPrompt(current, &lay, prompt);
+        current->screen.haveprompt = 0;
+    }
+
+    DRL("\nafter prompt: displaycol=%d, displayrow=%d\n", lay.col, lay.row);
+
+    /* (c) lay out the buffer, counting cols and rows */
     if (mlmode == 0) {
         /* In this mode we may need to trim chars from the start of the buffer until the
          * cursor fits in the window.
          */
-        pt = reduceSingleBuf(buf, current->cols - displaycol, &cursor_pos);
+        fitcols = current->cols - lay.col - 3;
+        first = cursor_pos;
+        offset = reduceSingleBuf(current, buf, current->cols - lay.col, &cursor_pos);
+        first -= cursor_pos;
+#ifdef USE_TERMIOS
+        if (current->linecache.shift && usecache && !redraw && first == 0 && prompt == current->prompt) {
+            /* Only one char was inserted or removed since the last frame, and the line
+             * has not scrolled, so let the terminal move the rest of the row.
+             */
+            screenShiftCells(current, current->linecache.shiftrow, current->linecache.shiftcol,
+                current->linecache.shift);
+        }
+#endif
+    }
+    else {
+        offset = 0;
+    }
+    current->linecache.shift = 0;
+
+    notecursor = -1;
+    if (currentpos) {
+        offset = current->linecache.chars[currentpos].offset;
+        if (cursor_pos < currentpos) {
+            cursorcol = current->linecache.chars[cursor_pos].col;
+            cursorrow = current->linecache.chars[cursor_pos].row;
+            notecursor = 0;
+        }
+    }
+
+    while (*(pt = bufText(current, buf, offset))) {
+        int ch;
+        int n = utf8_tounicode(pt, &ch);
+        int width;
+
+        if(ch == '\t') {
+            width = TAB_WIDTH - (lay.col % TAB_WIDTH);
+        }
+        else {
+            width = char_display_width(ch);
+        }
+
+        if (currentpos == cursor_pos) {
+            /* (c') wherever we output this character is where we want the cursor */
+            notecursor = 1;
+        }
+
+        if (lay.col + width >= current->cols) {
+            if (mlmode == 0) {
+                /* In single line mode stop once we print as much as we can on one line */
+                DRL("<slmode>");
+                break;
+            }
+            /* need to wrap to the next line since it doesn't fit */
+            layoutNewline(current, &lay);
+        }
+
+        if (notecursor == 1) {
+            /* (c') Save this position as the current cursor position */
+            cursorcol = lay.col;
+            cursorrow = lay.row;
+            notecursor = 0;
+            DRL("<cursor>");
+        }
+
+        if (usecache) {
+            int col = lay.col;
+            layoutDisplayChar(current, &lay, pt, n, ch, width);
+            linecacheAdd(current, currentpos, offset, lay.row, col, &lay);
+            /* Note how far the cursor could move before reduceSingleBuf() would scroll */
+            fitcols -= char_display_width(ch);
+            if (fitcols > 0 && maxcursor == currentpos - 1) {
+                maxcursor = currentpos;
+            }
+        }
+        else {
+            layoutDisplayChar(current, &lay, pt, n, ch, width);
+        }
+        DRL_CHAR(ch);
+        if (width != 1) {
+            DRL("<w=%d>", width);
+        }
+
+        offset += n;
+        currentpos++;
+    }
+    if (usecache) {
+        struct linecache *lc = &current->linecache;
+
+        lc->nchars = currentpos;
+        lc->first = first;
+        lc->shown = 1;
+        if (mlmode) {
+            lc->valid = currentpos;
+            lc->maxcursor = currentpos;
+        }
+        else {
+            if (*pt == 0 && maxcursor == currentpos - 1) {
+                /* It all fits, so the cursor can also be at the end */
+                maxcursor = currentpos;
+            }
+            lc->maxcursor = first ? -1 : maxcursor;
+        }
+    }
+
+    /* If we didn't see the cursor, it is at the current location */
+    if (notecursor) {
+        DRL("<cursor>");
+        cursorcol = lay.col;
+        cursorrow = lay.row;
+    }
+
+    DRL("\nafter buf: displaycol=%d, displayrow=%d, cursorcol=%d, cursorrow=%d\n", lay.col, lay.row, cursorcol, cursorrow);
+
+    /* (d) show hints */
+    refreshShowHints(current, &lay, buf);
+    layoutFlush(current, &lay);
+
+    /* (e) erase the rest of the last row, and any rows below it */
+    screenEndRow(current, lay.row, lay.col);
+    for (row = lay.row + 1; row < current->screen.rows; row++) {
+        screenEndRow(current, row, 0);
+    }
+    screenSetAttr(current, 0);
+
+    /* (f) move the cursor to the correct place */
+    screenMove(current, cursorrow, cursorcol);
+    screenEndChars(current);
+
+    DRL("\nafter refresh: nrows=%d, rpos=%d\n\n", current->nrows, current->rpos);
+
+    refreshEnd(current);
+
+#ifdef DEBUG_REFRESHLINE
+    fclose(dfh);
+#endif
+}
+
+/**
+ * Returns 1 if refreshing the line can be put off because more input is
+ * already waiting, so that a burst of keys results in a single refresh.
+ * The refresh is put off for at most max_refresh_delay ms.
+ */
+static int refreshDeferred(struct current *current)
+{
+#ifdef USE_TERMIOS
+    if (max_refresh_delay > 0 && fd_input_pending(current)) {
+        long now = monotonic_ms();
+        if (!current->refreshpending) {
+            current->refreshpending = 1;
+            current->refreshdeadline = now + max_refresh_delay;
+            return 1;
+        }
+        return now < current->refreshdeadline;
+    }
+#endif
+    return 0;
+}
+
+static void refreshLine(struct current *current)
+{
+    if (!refreshDeferred(current)) {
+        refreshLineAlt(current, current->prompt, NULL, current->pos);
+    }
+}
+
+/**
+ * If the terminal shows the current buffer and only current->pos has changed,
+ * moves the cursor to its position in the cached layout.
+ *
+ * Returns 1 if done, or 0 if the line must be refreshed, e.g. because it needs to scroll.
+ */
+static int refreshCursorOnly(struct current *current)
+{
+    const struct linecache *lc = &current->linecache;
+    const struct charpos *cp;
+    int pos = current->pos - lc->first;
+
+    getWindowSize(current);
+    if (!lc->shown || !current->screen.valid || lc->cols != current->cols ||
+        current->screen.prompt != current->prompt || lc->nchars == 0 || pos < 0 || pos > lc->maxcursor) {
+        return 0;
+    }
+    current->refreshpending = 0;
+
+    refreshStart(current);
+    if (pos < lc->nchars) {
+        cp = &lc->chars[pos];
+        screenMove(current, cp->row, cp->col);
     }
     else {
-        pt = buf;
+        /* At the end */
+        cp = &lc->chars[lc->nchars - 1];
+        screenMove(current, cp->row, cp->col + cp->width);
     }
+    screenEndChars(current);
+    refreshEnd(current);
+    return 1;
+}
 
-    currentpos = 0;
-    notecursor = -1;
-
-    while (*pt) {
-        int ch;
-        int n = utf8_tounicode(pt, &ch);
-        int width;
-
-        if(ch == '\t') {
-            width = TAB_WIDTH - (displaycol % TAB_WIDTH);
-        }
-        else {
-            width = char_display_width(ch);
-        }
-
-        if (currentpos == cursor_pos) {
-            /* (e') wherever we output this character is where we want the cursor */
-            notecursor = 1;
-        }
-
-        if (displaycol + width >= current->cols) {
-            if (mlmode == 0) {
-                /* In single line mode stop once we print as much as we can on one line */
-                DRL("<slmode>");
-                break;
-            }
-            /* need to wrap to the next line since it doesn't fit */
-            refreshNewline(current);
-            displaycol = 0;
-            displayrow++;
-        }
+/**
+ * Call this instead of refreshLine() if only current->pos has changed.
+ */
+static void refreshCursor(struct current *current)
+{
+    if (!refreshDeferred(current) && !refreshCursorOnly(current)) {
+        refreshLineAlt(current, current->prompt, NULL, current->pos);
+    }
+}
 
-        if (notecursor == 1) {
-            /* (e') Save this position as the current cursor position */
-            cursorcol = displaycol;
-            cursorrow = displayrow;
-            notecursor = 0;
-            DRL("<cursor>");
-        }
+/**
+ * Performs the refresh put off by refreshLine(), if any.
+ */
+static void refreshPending(struct current *current)
+{
+    if (current->refreshpending && !refreshCursorOnly(current)) {
+        refreshLineAlt(current, current->prompt, NULL, current->pos);
+    }
+}
 
-        displaycol += width;
+/**
+ * Adds the change about to be made to current->buf at byte 'offset' (char 'pos')
+ * to the undo journal: 'dellen' bytes deleted, then 'inslen' bytes from 'ins' inserted.
+ * Typed chars inserted one after another are added to the same entry.
+ */
+static void undoRecord(struct current *current, int pos, int offset, int dellen, const char *ins, int inslen, int typed)
+{
+    struct undojournal *undo = &current->undo;
+    struct undoentry *e;
 
-        if (ch != '\t' && ch < ' ') {
-            outputControlChar(current, ch + '@');
-        }
-        else {
-            outputChars(current, pt, n);
-        }
-        DRL_CHAR(ch);
-        if (width != 1) {
-            DRL("<w=%d>", width);
+    if (undo->text == NULL || undo->revision != sb_revision(current->buf)) {
+        /* Changed other than through the journal, e.g. by a character callback */
+        if (undo->text == NULL) {
+            undo->text = tmp_sb_alloc(current);
         }
-
-        pt += n;
-        currentpos++;
+        sb_clear(undo->text);
+        undo->count = undo->pos = 0;
+        undo->typing = 0;
     }
 
-    /* If we didn't see the cursor, it is at the current location */
-    if (notecursor) {
-        DRL("<cursor>");
-        cursorcol = displaycol;
-        cursorrow = displayrow;
+    /* Anything undone can no longer be redone */
+    if (undo->pos < undo->count) {
+        sb_delete(undo->text, undo->entries[undo->pos].text, -1);
+        undo->count = undo->pos;
     }
 
-    DRL("\nafter buf: displaycol=%d, displayrow=%d, cursorcol=%d, cursorrow=%d\n", displaycol, displayrow, cursorcol, cursorrow);
-
-    /* (f) show hints */
-    hint = refreshShowHints(current, buf, current->cols - displaycol, 1);
+    if (typed && undo->typing && !undo->group && undo->count) {
+        e = &undo->entries[undo->count - 1];
+        if (e->dellen == 0 && offset == e->offset + e->inslen) {
+            sb_append_len(undo->text, ins, inslen);
+            e->inslen += inslen;
+            return;
+        }
+    }
 
-    /* Remember how many many cols are available for insert optimisation */
-    if (prompt == current->prompt && hint == 0) {
-        current->colsright = current->cols - displaycol;
-        current->colsleft = displaycol;
+    if (undo->count == undo->alloc) {
+        undo->alloc = undo->alloc ? undo->alloc * 2 : 16;
+        undo->entries = (struct undoentry *)tmp_realloc(current, undo->entries, undo->alloc * sizeof(*undo->entries));
     }
-    else {
-        /* Can't optimise */
-        current->colsright = 0;
-        current->colsleft = 0;
+    e = &undo->entries[undo->count++];
+    e->offset = offset;
+    e->at = pos;
+    e->cursor = current->pos;
+    e->dellen = dellen;
+    e->inslen = inslen;
+    e->text = sb_len(undo->text);
+    e->joined = undo->join;
+    sb_append_part(undo->text, current->buf, offset, dellen);
+    if (inslen) {
+        sb_append_len(undo->text, ins, inslen);
     }
-    DRL("\nafter hints: colsleft=%d, colsright=%d\n\n", current->colsleft, current->colsright);
 
-    refreshEndChars(current);
+    undo->pos = undo->count;
+    undo->typing = typed;
+    undo->join = undo->group;
+}
 
-    /* (g) move the cursor to the correct place */
-    cursorUp(current, displayrow - cursorrow);
-    setCursorPos(current, cursorcol);
+/**
+ * Entries added to the undo journal until undoGroupEnd() are undone and redone
+ * all at once, and together with the entry before if 'join' is set.
+ */
+static void undoGroupStart(struct current *current, int join)
+{
+    current->undo.group = 1;
+    current->undo.join = join;
+}
 
-    /* (h) Update the number of rows if larger, but never reduce this */
-    if (displayrow >= current->nrows) {
-        current->nrows = displayrow + 1;
-    }
-    /* And remember the row that the cursor is on */
-    current->rpos = cursorrow;
+static void undoGroupEnd(struct current *current)
+{
+    current->undo.group = 0;
+    current->undo.join = 0;
+}
 
-    refreshEnd(current);
+/**
+ * Inserts 'len' bytes from 'str' at byte 'offset' (char 'pos') in current->buf,
+ * recording it in the undo journal. 'typed' is set for chars typed one at a time.
+ */
+static void bufInsert(struct current *current, int pos, int offset, const char *str, int len, int typed)
+{
+    undoRecord(current, pos, offset, 0, str, len, typed);
+    sb_insert_len(current->buf, offset, str, len);
+    current->undo.revision = sb_revision(current->buf);
+}
 
-#ifdef DEBUG_REFRESHLINE
-    fclose(dfh);
-#endif
+/**
+ * Deletes 'len' bytes at byte 'offset' (char 'pos') in current->buf,
+ * recording it in the undo journal.
+ */
+static void bufDelete(struct current *current, int pos, int offset, int len)
+{
+    undoRecord(current, pos, offset, len, NULL, 0, 0);
+    sb_delete(current->buf, offset, len);
+    current->undo.revision = sb_revision(current->buf);
 }
 
-static void refreshLine(struct current *current)
+/**
+ * Undoes (or redoes if 'redo' is set) the entry 'e' in the undo journal.
+ */
+static void undoApply(struct current *current, const struct undoentry *e, int redo)
 {
-    refreshLineAlt(current, current->prompt, sb_str(current->buf), current->pos);
+    const char *text = sb_str(current->undo.text) + e->text;
+    const char *ins = text + e->dellen;
+    int removelen = e->inslen;
+    int insertlen = e->dellen;
+
+    if (redo) {
+        removelen = e->dellen;
+        insertlen = e->inslen;
+    }
+    else {
+        ins = text;
+    }
+    sb_delete(current->buf, e->offset, removelen);
+    if (insertlen) {
+        sb_insert_len(current->buf, e->offset, ins, insertlen);
+    }
+    linecacheInvalidate(current, e->at);
+    current->pos = redo ? e->at + utf8_strlen(ins, insertlen) : e->cursor;
 }
 
-static void set_current(struct current *current, const char *str)
+/**
+ * Undoes the last change to the line (or redoes the last change undone if 'redo'
+ * is set), along with any changes joined to it.
+ *
+ * Returns 1 if the line needs to be refreshed and 0 if there was nothing to do.
+ */
+static int undo_change(struct current *current, int redo)
 {
-    sb_clear(current->buf);
-    sb_append(current->buf, str);
-    current->pos = sb_chars(current->buf);
+    struct undojournal *undo = &current->undo;
+
+    if (undo->text == NULL || undo->revision != sb_revision(current->buf)) {
+        return 0;
+    }
+    if (redo) {
+        if (undo->pos == undo->count) {
+            return 0;
+        }
+        do {
+            undoApply(current, &undo->entries[undo->pos++], 1);
+        } while (undo->pos < undo->count && undo->entries[undo->pos].joined);
+    }
+    else {
+        int joined;
+
+        if (undo->pos == 0) {
+            return 0;
+        }
+        do {
+            joined = undo->entries[--undo->pos].joined;
+            undoApply(current, &undo->entries[undo->pos], 0);
+        } while (joined && undo->pos > 0);
+    }
+    undo->revision = sb_revision(current->buf);
+    undo->typing = 0;
+    return 1;
 }
 
 /**
  * Removes the char at 'pos'.
  *
- * Returns 1 if the line needs to be refreshed, 2 if not
- * and 0 if nothing was removed
+ * Returns 1 if the line needs to be refreshed and 0 if nothing was removed
  */
 static int remove_char(struct current *current, int pos)
 {
     if (pos >= 0 && pos < sb_chars(current->buf)) {
-        int offset = utf8_index(sb_str(current->buf), pos);
-        int nbytes = utf8_index(sb_str(current->buf) + offset, 1);
-        int rc = 1;
-
-        /* Now we try to optimise in the simple but very common case that:
-         * - outputChars() can be used directly (not win32)
-         * - we are removing the char at EOL
-         * - the buffer is not empty
-         * - there are columns available to the left
-         * - the char being deleted is not a wide or utf-8 character
-         * - no hints are being shown
-         */
-        if (current->output && current->pos == pos + 1 && current->pos == sb_chars(current->buf) && pos > 0) {
-#ifdef USE_UTF8
-            /* Could implement utf8_prev_len() but simplest just to not optimise this case */
-            char last = sb_str(current->buf)[offset];
-#else
-            char last = 0;
-#endif
-            if (current->colsleft > 0 && (last & 0x80) == 0) {
-                /* Have cols on the left and not a UTF-8 char or continuation */
-                /* Yes, can optimise */
-                current->colsleft--;
-                current->colsright++;
-                rc = 2;
-            }
-        }
+        int offset = sb_index(current->buf, pos);
+        int nbytes = sb_index(current->buf, pos + 1) - offset;
 
-        sb_delete(current->buf, offset, nbytes);
+        int shown = current->linecache.shown;
+
+        bufDelete(current, pos, offset, nbytes);
+        linecacheInvalidate(current, pos);
+        if (shown) {
+            linecacheShift(current, pos, -1);
+        }
 
         if (current->pos > pos) {
             current->pos--;
         }
-        if (rc == 2) {
-            if (refreshShowHints(current, sb_str(current->buf), current->colsright, 0)) {
-                /* A hint needs to be shown, so can't optimise after all */
-                rc = 1;
-            }
-            else {
-                /* optimised output */
-                outputChars(current, "\b \b", 3);
-            }
-        }
-        return rc;
+        return 1;
     }
     return 0;
 }
 
 /**
- * Insert 'ch' at position 'pos'
+ * Insert 'ch' at position 'pos'. 'typed' is set if 'ch' was typed as itself,
+ * so that it can be undone together with the chars typed just before.
  *
- * Returns 1 if the line needs to be refreshed, 2 if not
- * and 0 if nothing was inserted (no room)
+ * Returns 1 if the line needs to be refreshed and 0 if nothing was inserted (no room)
  */
-static int insert_char(struct current *current, int pos, int ch)
+static int insert_typed(struct current *current, int pos, int ch, int typed)
 {
     if (pos >= 0 && pos <= sb_chars(current->buf)) {
-        char buf[MAX_UTF8_LEN + 1];
-        int offset = utf8_index(sb_str(current->buf), pos);
+        char buf[MAX_UTF8_LEN];
+        int offset = sb_index(current->buf, pos);
         int n = utf8_getchars(buf, ch);
-        int rc = 1;
-
-        /* null terminate since sb_insert() requires it */
-        buf[n] = 0;
+        int shown = current->linecache.shown;
 
-        /* Now we try to optimise in the simple but very common case that:
-         * - outputChars() can be used directly (not win32)
-         * - we are inserting at EOL
-         * - there are enough columns available
-         * - no hints are being shown
-         */
-        if (current->output && pos == current->pos && pos == sb_chars(current->buf)) {
-            int width = char_display_width(ch);
-            if (current->colsright > width) {
-                /* Yes, can optimise */
-                current->colsright -= width;
-                current->colsleft -= width;
-                rc = 2;
-            }
+        bufInsert(current, pos, offset, buf, n, typed);
+        linecacheInvalidate(current, pos);
+        if (shown) {
+            linecacheShift(current, pos, ch);
         }
-        sb_insert(current->buf, offset, buf);
         if (current->pos >= pos) {
             current->pos++;
         }
-        if (rc == 2) {
-            if (refreshShowHints(current, sb_str(current->buf), current->colsright, 0)) {
-                /* A hint needs to be shown, so can't optimise after all */
-                rc = 1;
-            }
-            else {
-                /* optimised output */
-                outputChars(current, buf, n);
-            }
-        }
-        return rc;
+        return 1;
     }
     return 0;
 }
 
+static int insert_char(struct current *current, int pos, int ch)
+{
+    return insert_typed(current, pos, ch, 0);
+}
+
 /**
  * Captures up to 'n' characters starting at 'pos' for the cut buffer.
  *
@@ -1488,21 +3970,59 @@ static int insert_char(struct current *current, int pos, int ch)
 static void capture_chars(struct current *current, int pos, int nchars)
 {
     if (pos >= 0 && (pos + nchars - 1) < sb_chars(current->buf)) {
-        int offset = utf8_index(sb_str(current->buf), pos);
-        int nbytes = utf8_index(sb_str(current->buf) + offset, nchars);
+        sb_iter it;
+        int offset;
 
-        if (nbytes > 0) {
+        sb_iter_init(&it, current->buf, pos);
+        offset = it.index;
+        while (nchars-- > 0 && sb_iter_next(&it) >= 0) {
+        }
+
+        if (it.index > offset) {
             if (current->capture) {
                 sb_clear(current->capture);
             }
             else {
-                current->capture = sb_alloc();
+                current->capture = tmp_sb_alloc(current);
             }
-            sb_append_len(current->capture, sb_str(current->buf) + offset, nbytes);
+            sb_append_part(current->capture, current->buf, offset, it.index - offset);
         }
     }
 }
 
+/**
+ * Removes up to 'n' characters at 'pos' with a single buffer operation,
+ * without saving them.
+ *
+ * Returns the number of chars removed.
+ */
+static int delete_chars(struct current *current, int pos, int n)
+{
+    sb_iter it;
+    int offset;
+    int removed;
+
+    if (pos < 0 || pos >= sb_chars(current->buf) || n <= 0) {
+        return 0;
+    }
+
+    sb_iter_init(&it, current->buf, pos);
+    offset = it.index;
+    while (n-- > 0 && sb_iter_next(&it) >= 0) {
+    }
+    removed = it.pos - pos;
+
+    bufDelete(current, pos, offset, it.index - offset);
+    linecacheInvalidate(current, pos);
+    if (current->pos >= pos + removed) {
+        current->pos -= removed;
+    }
+    else if (current->pos > pos) {
+        current->pos = pos;
+    }
+    return removed;
+}
+
 /**
  * Removes up to 'n' characters at cursor position 'pos'.
  *
@@ -1510,47 +4030,130 @@ static void capture_chars(struct current *current, int pos, int nchars)
  */
 static int remove_chars(struct current *current, int pos, int n)
 {
-    int removed = 0;
-
     /* First save any chars which will be removed */
     capture_chars(current, pos, n);
 
-    while (n-- && remove_char(current, pos)) {
-        removed++;
+    if (n == 1) {
+        /* This can move the rest of the row rather than redraw it */
+        return remove_char(current, pos);
     }
-    return removed;
+    return delete_chars(current, pos, n);
 }
+
 /**
  * Inserts the characters (string) 'chars' at the cursor position 'pos'.
+ * 'typed' is set as for insert_typed().
  *
  * Returns 0 if no chars were inserted or non-zero otherwise.
  */
+static int insert_string(struct current *current, int pos, const char *chars, int typed)
+{
+    if (pos >= 0 && pos <= sb_chars(current->buf) && *chars) {
+        int offset = sb_index(current->buf, pos);
+        int inserted = sb_chars(current->buf);
+
+        /* All at once, rather than a char at a time */
+        bufInsert(current, pos, offset, chars, strlen(chars), typed);
+        inserted = sb_chars(current->buf) - inserted;
+        linecacheInvalidate(current, pos);
+        if (current->pos >= pos) {
+            current->pos += inserted;
+        }
+        return inserted;
+    }
+    return 0;
+}
+
 static int insert_chars(struct current *current, int pos, const char *chars)
 {
-    int inserted = 0;
+    return insert_string(current, pos, chars, 0);
+}
+
+/**
+ * Replaces the buffer with 'str' and moves the cursor to the end.
+ *
+ * Only the part after any prefix in common with the current buffer is replaced,
+ * e.g. when going through completions or similar history entries, so that the
+ * layout of the prefix can be reused.
+ */
+static void set_current(struct current *current, const char *str)
+{
+    const char *old = sb_str(current->buf);
+    int i = 0;
+    int keep;
+
+    if (old == NULL) {
+        /* Nothing added yet */
+        sb_append(current->buf, str);
+        current->pos = sb_chars(current->buf);
+        linecacheInvalidate(current, 0);
+        return;
+    }
+    while (old[i] && old[i] == str[i]) {
+        i++;
+    }
+#ifdef USE_UTF8
+    /* Back up to the start of a char */
+    while (i > 0 && ((old[i] & 0xc0) == 0x80 || (str[i] & 0xc0) == 0x80)) {
+        i--;
+    }
+#endif
+    keep = utf8_strlen(old, i);
+
+    /* Undone all at once */
+    undoGroupStart(current, 0);
+    delete_chars(current, keep, sb_chars(current->buf) - keep);
+    insert_chars(current, keep, str + i);
+    undoGroupEnd(current);
+    current->pos = sb_chars(current->buf);
+}
+
+/* Character classes for word motion */
+enum {
+    CHAR_WORD,          /* part of a word */
+    CHAR_BREAK,         /* separates words */
+};
+
+static unsigned char char_class[256]; /* CHAR_xxx for each char below 256 */
+static int char_class_ready = 0;
 
+void linenoiseSetWordBreakChars(const char *chars)
+{
+    memset(char_class, CHAR_WORD, sizeof(char_class));
     while (*chars) {
-        int ch;
-        int n = utf8_tounicode(chars, &ch);
-        if (insert_char(current, pos, ch) == 0) {
-            break;
-        }
-        inserted++;
-        pos++;
-        chars += n;
+        char_class[(unsigned char)*chars++] = CHAR_BREAK;
+    }
+    char_class_ready = 1;
+}
+
+/**
+ * Returns 1 if 'ch' separates words, or 0 if it is part of one.
+ */
+static int is_word_break(int ch)
+{
+    if (!char_class_ready) {
+        linenoiseSetWordBreakChars(" ");
     }
-    return inserted;
+    return ch >= 0 && ch < 256 && char_class[ch] == CHAR_BREAK;
 }
 
+/**
+ * Moves the cursor in direction 'dir' (1 or -1) over chars that separate words
+ * if 'check_is_space' is set, or otherwise over chars that are part of a word.
+ *
+ * Returns the number of chars moved over.
+ */
 static int skip_space_nonspace(struct current *current, int dir, int check_is_space)
 {
     int moved = 0;
-    int checkoffset = (dir < 0) ? -1 : 0;
-    int limit = (dir < 0) ? 0 : sb_chars(current->buf);
-    while (current->pos != limit && (get_char(current, current->pos + checkoffset) == ' ') == check_is_space) {
-        current->pos += dir;
+    sb_iter it;
+    int c;
+
+    sb_iter_init(&it, current->buf, current->pos);
+    while ((c = (dir < 0) ? sb_iter_prev(&it) : sb_iter_next(&it)) >= 0 && is_word_break(c) == check_is_space) {
         moved++;
     }
+    current->pos += dir * moved;
     return moved;
 }
 
@@ -1569,8 +4172,7 @@ static void set_history_index(struct current *current, int new_index)
     if (history_len > 1) {
         /* Update the current history entry before to
          * overwrite it with the next one. */
-        free(history[history_len - 1 - history_index]);
-        history[history_len - 1 - history_index] = strdup(sb_str(current->buf));
+        history_replace(history_len - 1 - history_index, sb_str(current->buf));
         /* Show the new entry */
         history_index = new_index;
         if (history_index < 0) {
@@ -1578,355 +4180,567 @@ static void set_history_index(struct current *current, int new_index)
         } else if (history_index >= history_len) {
             history_index = history_len - 1;
         } else {
-            set_current(current, history[history_len - 1 - history_index]);
+            set_current(current, history_str(history_len - 1 - history_index));
             refreshLine(current);
         }
     }
 }
 
 /**
- * Returns the keycode to process, or 0 if none.
+ * Shows the reverse-i-search prompt with the line found.
  */
-static int reverseIncrementalSearch(struct current *current)
+static void searchShow(struct current *current)
 {
-    /* Display the reverse-i-search prompt and process chars */
-    char rbuf[50];
-    char rprompt[80];
-    int rchars = 0;
-    int rlen = 0;
-    int searchpos = history_len - 1;
-    int c;
+    struct searchstate *search = &current->search;
 
-    rbuf[0] = 0;
-    while (1) {
-        int n = 0;
-        const char *p = NULL;
-        int skipsame = 0;
-        int searchdir = -1;
-
-        snprintf(rprompt, sizeof(rprompt), "(reverse-i-search)'%s': ", rbuf);
-        refreshLineAlt(current, rprompt, sb_str(current->buf), current->pos);
-        c = fd_read(current);
-        if (c == ctrl('H') || c == SPECIAL_BACKSPACE) {
-            if (rchars) {
-                int p_ind = utf8_index(rbuf, --rchars);
-                rbuf[p_ind] = 0;
-                rlen = strlen(rbuf);
-            }
-            continue;
+    snprintf(search->prompt, sizeof(search->prompt), "(reverse-i-search)'%s': ", search->buf);
+    refreshLineAlt(current, search->prompt, NULL, current->pos);
+}
+
+/**
+ * Called for ctrl-R to start a reverse incremental search in EDIT_SEARCH mode.
+ * See searchKey().
+ */
+static void searchStart(struct current *current)
+{
+    struct searchstate *search = &current->search;
+
+    search->buf[0] = 0;
+    search->chars = 0;
+    search->len = 0;
+    search->pos = history_len - 1;
+    current->mode = EDIT_SEARCH;
+    searchShow(current);
+}
+
+/**
+ * Handles key 'c' in EDIT_SEARCH mode.
+ *
+ * Returns the keycode to process, or 0 if none.
+ */
+static int searchKey(struct current *current, int c)
+{
+    struct searchstate *search = &current->search;
+    int n = 0;
+    const char *p = NULL;
+    int skipsame = 0;
+    int searchdir = -1;
+
+    if (c == ctrl('H') || c == SPECIAL_BACKSPACE) {
+        if (search->chars) {
+            int p_ind = utf8_index(search->buf, --search->chars);
+            search->buf[p_ind] = 0;
+            search->len = strlen(search->buf);
         }
+        searchShow(current);
+        return 0;
+    }
 #ifdef USE_TERMIOS
-        if (c == SPECIAL_ESCAPE) {
-            c = check_special(current->fd);
-        }
+    if (c == SPECIAL_ESCAPE) {
+        c = decodeKey(current);
+    }
 #endif
-        if (c == ctrl('R')) {
-            /* Search for the previous (earlier) match */
-            if (searchpos > 0) {
-                searchpos--;
-            }
-            skipsame = 1;
+    if (c == ctrl('R')) {
+        /* Search for the previous (earlier) match */
+        if (search->pos > 0) {
+            search->pos--;
         }
-        else if (c == ctrl('S')) {
-            /* Search for the next (later) match */
-            if (searchpos < history_len) {
-                searchpos++;
-            }
-            searchdir = 1;
-            skipsame = 1;
+        skipsame = 1;
+    }
+    else if (c == ctrl('S')) {
+        /* Search for the next (later) match */
+        if (search->pos < history_len) {
+            search->pos++;
+        }
+        searchdir = 1;
+        skipsame = 1;
+    }
+    else if (c == ctrl('P') || c == SPECIAL_UP) {
+        /* Exit Ctrl-R mode and go to the previous history line from the current search pos */
+        current->mode = EDIT_NORMAL;
+        set_history_index(current, history_len - search->pos);
+        refreshLine(current);
+        return 0;
+    }
+    else if (c == ctrl('N') || c == SPECIAL_DOWN) {
+        /* Exit Ctrl-R mode and go to the next history line from the current search pos */
+        current->mode = EDIT_NORMAL;
+        set_history_index(current, history_len - search->pos - 2);
+        refreshLine(current);
+        return 0;
+    }
+    else if (c >= ' ' && c <= '~') {
+        /* >= here to allow for null terminator */
+        if (search->len >= (int)sizeof(search->buf) - MAX_UTF8_LEN) {
+            searchShow(current);
+            return 0;
         }
-        else if (c == ctrl('P') || c == SPECIAL_UP) {
-            /* Exit Ctrl-R mode and go to the previous history line from the current search pos */
-            set_history_index(current, history_len - searchpos);
+
+        n = utf8_getchars(search->buf + search->len, c);
+        search->len += n;
+        search->chars++;
+        search->buf[search->len] = 0;
+
+        /* Adding a new char resets the search location */
+        search->pos = history_len - 1;
+    }
+    else {
+        /* Exit from incremental search mode */
+        current->mode = EDIT_NORMAL;
+        if (c == ctrl('G') || c == ctrl('C')) {
+            /* ctrl-g terminates the search with no effect */
+            set_current(current, "");
+            history_index = 0;
             c = 0;
-            break;
         }
-        else if (c == ctrl('N') || c == SPECIAL_DOWN) {
-            /* Exit Ctrl-R mode and go to the next history line from the current search pos */
-            set_history_index(current, history_len - searchpos - 2);
+        else if (c == ctrl('J')) {
+            /* ctrl-j terminates the search leaving the buffer in place */
+            history_index = 0;
             c = 0;
-            break;
         }
-        else if (c >= ' ' && c <= '~') {
-            /* >= here to allow for null terminator */
-            if (rlen >= (int)sizeof(rbuf) - MAX_UTF8_LEN) {
-                continue;
-            }
+        /* Go process the char normally */
+        refreshLine(current);
+        return c;
+    }
 
-            n = utf8_getchars(rbuf + rlen, c);
-            rlen += n;
-            rchars++;
-            rbuf[rlen] = 0;
+    /* Now search through the history for a match */
+    for (; search->pos >= 0 && search->pos < history_len; search->pos += searchdir) {
+        const char *entry = history_str(search->pos);
 
-            /* Adding a new char resets the search location */
-            searchpos = history_len - 1;
-        }
-        else {
-            /* Exit from incremental search mode */
+        p = strstr(entry, search->buf);
+        if (p) {
+            /* Found a match */
+            if (skipsame && strcmp(entry, sb_str(current->buf)) == 0) {
+                /* But it is identical, so skip it */
+                continue;
+            }
+            /* Copy the matching line and set the cursor position */
+            history_index = history_len - 1 - search->pos;
+            set_current(current, entry);
+            current->pos = utf8_strlen(entry, p - entry);
             break;
         }
+    }
+    if (!p && n) {
+        /* No match, so don't add it */
+        search->chars--;
+        search->len -= n;
+        search->buf[search->len] = 0;
+    }
+    searchShow(current);
+    return 0;
+}
 
-        /* Now search through the history for a match */
-        for (; searchpos >= 0 && searchpos < history_len; searchpos += searchdir) {
-            p = strstr(history[searchpos], rbuf);
-            if (p) {
-                /* Found a match */
-                if (skipsame && strcmp(history[searchpos], sb_str(current->buf)) == 0) {
-                    /* But it is identical, so skip it */
-                    continue;
-                }
-                /* Copy the matching line and set the cursor position */
-                history_index = history_len - 1 - searchpos;
-                set_current(current,history[searchpos]);
-                current->pos = utf8_strlen(history[searchpos], p - history[searchpos]);
-                break;
-            }
-        }
-        if (!p && n) {
-            /* No match, so don't add it */
-            rchars--;
-            rlen -= n;
-            rbuf[rlen] = 0;
-        }
+#ifdef USE_TERMIOS
+/**
+ * Called at the end of the paste in EDIT_PASTE mode to insert the text.
+ */
+static void pasteEnd(struct current *current)
+{
+    if (sb_len(current->paste) && insert_chars(current, current->pos, sb_str(current->paste))) {
+        refreshLine(current);
     }
-    if (c == ctrl('G') || c == ctrl('C')) {
-        /* ctrl-g terminates the search with no effect */
-        set_current(current, "");
-        history_index = 0;
-        c = 0;
+    sb_free(current->paste);
+    current->paste = NULL;
+    current->mode = EDIT_NORMAL;
+}
+#endif
+
+/**
+ * Leaves any special mode, e.g. on error, with the line left as it is.
+ */
+static void editModeEnd(struct current *current)
+{
+    switch (current->mode) {
+    case EDIT_LITERAL:
+        /* Remove the ^V */
+        remove_char(current, current->pos - 1);
+        break;
+#ifndef NO_COMPLETION
+    case EDIT_COMPLETE:
+        completeEnd(current);
+        break;
+#endif
+#ifdef USE_TERMIOS
+    case EDIT_PASTE:
+        pasteEnd(current);
+        break;
+#endif
     }
-    else if (c == ctrl('J')) {
-        /* ctrl-j terminates the search leaving the buffer in place */
-        history_index = 0;
-        c = 0;
+    if (current->mode != EDIT_NORMAL) {
+        current->mode = EDIT_NORMAL;
+        refreshLine(current);
     }
-    /* Go process the char normally */
-    refreshLine(current);
-    return c;
 }
 
-static int linenoiseEdit(struct current *current) {
-    history_index = 0;
-
-    refreshLine(current);
+/**
+ * Processes the key 'c', or -1 for an error, for the line being edited.
+ *
+ * Returns LINENOISE_EDIT_MORE to continue editing, LINENOISE_EDIT_DONE if the
+ * line is complete (or on error), or LINENOISE_EDIT_EOF for EOF or ctrl-C.
+ */
+static int linenoiseEditKey(struct current *current, int c)
+{
+    if (c == -1) {
+        /* Return on errors */
+        editModeEnd(current);
+        return LINENOISE_EDIT_DONE;
+    }
 
-    while(1) {
-        int c = fd_read(current);
+    if (current->mode == EDIT_LITERAL) {
+        current->mode = EDIT_NORMAL;
+        /* Undone together with inserting the ^V */
+        undoGroupStart(current, 1);
+        /* Remove the ^V first */
+        remove_char(current, current->pos - 1);
+        if (c > 0) {
+            /* Insert the actual char, can't be error or null */
+            insert_char(current, current->pos, c);
+        }
+        undoGroupEnd(current);
+        refreshLine(current);
+        return LINENOISE_EDIT_MORE;
+    }
 
 #ifndef NO_COMPLETION
-        /* Only autocomplete when the callback is set. It returns < 0 when
-         * there was an error reading from fd. Otherwise it will return the
-         * character that should be handled next. */
-        if (c == '\t' && current->pos == sb_chars(current->buf) && completionCallback != NULL) {
-            c = completeLine(current);
-        }
+    /* Only autocomplete when the callback is set. Once the completion is
+     * chosen, go on to process the key that ended it. */
+    if (current->mode == EDIT_COMPLETE) {
+        c = completeKey(current, c);
+    }
+    else if (c == '\t' && current->pos == sb_chars(current->buf) && completionCallback != NULL) {
+        completeStart(current);
+        return LINENOISE_EDIT_MORE;
+    }
 #endif
-        if (c == ctrl('R')) {
-            /* reverse incremental search will provide an alternative keycode or 0 for none */
-            c = reverseIncrementalSearch(current);
-            /* go on to process the returned char normally */
-        }
+    if (current->mode == EDIT_SEARCH) {
+        /* reverse incremental search will provide an alternative keycode or 0 for none */
+        c = searchKey(current, c);
+        /* go on to process the returned char normally */
+    }
+    else if (c == ctrl('R')) {
+        searchStart(current);
+        return LINENOISE_EDIT_MORE;
+    }
 
 #ifdef USE_TERMIOS
-        if (c == SPECIAL_ESCAPE) {   /* escape sequence */
-            c = check_special(current->fd);
-        }
+    if (c == SPECIAL_ESCAPE) {   /* escape sequence */
+        c = decodeKey(current);
+    }
 #endif
-        if (c == -1) {
-            /* Return on errors */
-            return sb_len(current->buf);
-        }
 
-        switch(c) {
-        case SPECIAL_NONE:
-            break;
-        case '\r':    /* enter/CR */
-        case '\n':    /* LF */
-            history_len--;
-            free(history[history_len]);
-            current->pos = sb_chars(current->buf);
-            if (mlmode || hintsCallback) {
-                showhints = 0;
-                refreshLine(current);
-                showhints = 1;
-            }
-            return sb_len(current->buf);
-        case ctrl('C'):     /* ctrl-c */
-            errno = EAGAIN;
-            return -1;
-        case ctrl('Z'):     /* ctrl-z */
+    switch(c) {
+    case SPECIAL_NONE:
+        break;
+    case '\r':    /* enter/CR */
+    case '\n':    /* LF */
+        history_drop_last();
+        current->pos = sb_chars(current->buf);
+        if (mlmode || hintsCallback) {
+            showhints = 0;
+            refreshLineAlt(current, current->prompt, NULL, current->pos);
+            showhints = 1;
+        }
+        refreshPending(current);
+        return LINENOISE_EDIT_DONE;
+    case ctrl('C'):     /* ctrl-c */
+        errno = EAGAIN;
+        return LINENOISE_EDIT_EOF;
+    case ctrl('Z'):     /* ctrl-z */
 #ifdef SIGTSTP
-            /* send ourselves SIGSUSP */
-            disableRawMode(current);
-            raise(SIGTSTP);
-            /* and resume */
-            enableRawMode(current);
-            refreshLine(current);
+        /* send ourselves SIGSUSP */
+        refreshPending(current);
+        disableRawMode(current);
+        raise(SIGTSTP);
+        /* and resume */
+        enableRawMode(current);
+        screenInvalidate(current);
+        refreshLine(current);
 #endif
-            continue;
-        case SPECIAL_BACKSPACE:
-        case ctrl('H'):
-            if (remove_char(current, current->pos - 1) == 1) {
-                refreshLine(current);
-            }
-            break;
-        case ctrl('D'):     /* ctrl-d */
-            if (sb_len(current->buf) == 0) {
-                /* Empty line, so EOF */
-                history_len--;
-                free(history[history_len]);
-                return -1;
-            }
-            /* Otherwise fall through to delete char to right of cursor */
-            /* fall-thru */
-        case SPECIAL_DELETE:
-            if (remove_char(current, current->pos) == 1) {
-                refreshLine(current);
-            }
-            break;
-        case SPECIAL_INSERT:
-            /* Ignore. Expansion Hook.
-             * Future possibility: Toggle Insert/Overwrite Modes
-             */
-            break;
-        case meta('b'):    /* meta-b, move word left */
-            if (skip_nonspace(current, -1)) {
-                refreshLine(current);
-            }
-            else if (skip_space(current, -1)) {
-                skip_nonspace(current, -1);
-                refreshLine(current);
-            }
-            break;
-        case meta('f'):    /* meta-f, move word right */
-            if (skip_space(current, 1)) {
-                refreshLine(current);
-            }
-            else if (skip_nonspace(current, 1)) {
-                skip_space(current, 1);
-                refreshLine(current);
+        break;
+    case SPECIAL_BACKSPACE:
+    case ctrl('H'):
+        if (remove_char(current, current->pos - 1)) {
+            refreshLine(current);
+        }
+        break;
+    case ctrl('D'):     /* ctrl-d */
+        if (sb_len(current->buf) == 0) {
+            /* Empty line, so EOF */
+            history_drop_last();
+            return LINENOISE_EDIT_EOF;
+        }
+        /* Otherwise fall through to delete char to right of cursor */
+        /* fall-thru */
+    case SPECIAL_DELETE:
+        if (remove_char(current, current->pos)) {
+            refreshLine(current);
+        }
+        break;
+    case SPECIAL_INSERT:
+        /* Ignore. Expansion Hook.
+         * Future possibility: Toggle Insert/Overwrite Modes
+         */
+        break;
+    case meta('b'):    /* meta-b, move word left */
+        if (skip_nonspace(current, -1)) {
+            refreshCursor(current);
+        }
+        else if (skip_space(current, -1)) {
+            skip_nonspace(current, -1);
+            refreshCursor(current);
+        }
+        break;
+    case meta('f'):    /* meta-f, move word right */
+        if (skip_space(current, 1)) {
+            refreshCursor(current);
+        }
+        else if (skip_nonspace(current, 1)) {
+            skip_space(current, 1);
+            refreshCursor(current);
+        }
+        break;
+    case ctrl('W'):    /* ctrl-w, delete word at left. save deleted chars */
+        /* eat any spaces on the left */
+        {
+            int pos = current->pos;
+            sb_iter it;
+            int ch;
+
+            sb_iter_init(&it, current->buf, pos);
+            while ((ch = sb_iter_prev(&it)) >= 0 && is_word_break(ch)) {
+                pos--;
             }
-            break;
-        case ctrl('W'):    /* ctrl-w, delete word at left. save deleted chars */
-            /* eat any spaces on the left */
-            {
-                int pos = current->pos;
-                while (pos > 0 && get_char(current, pos - 1) == ' ') {
-                    pos--;
-                }
 
-                /* now eat any non-spaces on the left */
-                while (pos > 0 && get_char(current, pos - 1) != ' ') {
-                    pos--;
-                }
-
-                if (remove_chars(current, pos, current->pos - pos)) {
-                    refreshLine(current);
-                }
-            }
-            break;
-        case ctrl('T'):    /* ctrl-t */
-            if (current->pos > 0 && current->pos <= sb_chars(current->buf)) {
-                /* If cursor is at end, transpose the previous two chars */
-                int fixer = (current->pos == sb_chars(current->buf));
-                c = get_char(current, current->pos - fixer);
-                remove_char(current, current->pos - fixer);
-                insert_char(current, current->pos - 1, c);
-                refreshLine(current);
-            }
-            break;
-        case ctrl('V'):    /* ctrl-v */
-            /* Insert the ^V first */
-            if (insert_char(current, current->pos, c)) {
-                refreshLine(current);
-                /* Now wait for the next char. Can insert anything except \0 */
-                c = fd_read(current);
-
-                /* Remove the ^V first */
-                remove_char(current, current->pos - 1);
-                if (c > 0) {
-                    /* Insert the actual char, can't be error or null */
-                    insert_char(current, current->pos, c);
-                }
-                refreshLine(current);
-            }
-            break;
-        case SPECIAL_LEFT:
-            if (current->pos > 0) {
-                current->pos--;
-                refreshLine(current);
+            /* now eat any non-spaces on the left, from the one just read */
+            while (ch >= 0 && !is_word_break(ch)) {
+                pos--;
+                ch = sb_iter_prev(&it);
             }
-            break;
-        case SPECIAL_RIGHT:
-            if (current->pos < sb_chars(current->buf)) {
-                current->pos++;
+
+            if (remove_chars(current, pos, current->pos - pos)) {
                 refreshLine(current);
             }
-            break;
-        case SPECIAL_PAGE_UP: /* move to start of history */
-          set_history_index(current, history_len - 1);
-          break;
-        case SPECIAL_PAGE_DOWN: /* move to 0 == end of history, i.e. current */
-          set_history_index(current, 0);
-          break;
-        case SPECIAL_UP:
-            set_history_index(current, history_index + 1);
-            break;
-        case SPECIAL_DOWN:
-            set_history_index(current, history_index - 1);
-            break;
-        case SPECIAL_HOME:
-            current->pos = 0;
+        }
+        break;
+    case ctrl('T'):    /* ctrl-t */
+        if (current->pos > 0 && current->pos <= sb_chars(current->buf)) {
+            /* If cursor is at end, transpose the previous two chars */
+            int fixer = (current->pos == sb_chars(current->buf));
+            c = get_char(current, current->pos - fixer);
+            undoGroupStart(current, 0);
+            remove_char(current, current->pos - fixer);
+            insert_char(current, current->pos - 1, c);
+            undoGroupEnd(current);
             refreshLine(current);
-            break;
-        case SPECIAL_END:
-            current->pos = sb_chars(current->buf);
+        }
+        break;
+    case ctrl('_'):    /* ctrl-_, undo */
+        if (undo_change(current, 0)) {
             refreshLine(current);
-            break;
-        case ctrl('U'): /* Ctrl+u, delete to beginning of line, save deleted chars. */
-            if (remove_chars(current, 0, current->pos)) {
-                refreshLine(current);
-            }
-            break;
-        case ctrl('K'): /* Ctrl+k, delete from current to end of line, save deleted chars. */
-            if (remove_chars(current, current->pos, sb_chars(current->buf) - current->pos)) {
-                refreshLine(current);
-            }
-            break;
-        case ctrl('Y'): /* Ctrl+y, insert saved chars at current position */
-            if (current->capture && insert_chars(current, current->pos, sb_str(current->capture))) {
-                refreshLine(current);
-            }
-            break;
-        case ctrl('L'): /* Ctrl+L, clear screen */
-            linenoiseClearScreen();
-            /* Force recalc of window size for serial terminals */
-            current->cols = 0;
-            current->rpos = 0;
+        }
+        break;
+    case meta('_'):    /* meta-_, redo */
+        if (undo_change(current, 1)) {
+            refreshLine(current);
+        }
+        break;
+    case ctrl('V'):    /* ctrl-v */
+        /* Insert the ^V first */
+        if (insert_char(current, current->pos, c)) {
+            refreshLine(current);
+            /* Now wait for the next char. Can insert anything except \0 */
+            current->mode = EDIT_LITERAL;
+        }
+        break;
+    case SPECIAL_LEFT:
+        if (current->pos > 0) {
+            current->pos--;
+            refreshCursor(current);
+        }
+        break;
+    case SPECIAL_RIGHT:
+        if (current->pos < sb_chars(current->buf)) {
+            current->pos++;
+            refreshCursor(current);
+        }
+        break;
+    case SPECIAL_PAGE_UP: /* move to start of history */
+      set_history_index(current, history_len - 1);
+      break;
+    case SPECIAL_PAGE_DOWN: /* move to 0 == end of history, i.e. current */
+      set_history_index(current, 0);
+      break;
+    case SPECIAL_UP:
+        set_history_index(current, history_index + 1);
+        break;
+    case SPECIAL_DOWN:
+        set_history_index(current, history_index - 1);
+        break;
+    case SPECIAL_HOME:
+        current->pos = 0;
+        refreshCursor(current);
+        break;
+    case SPECIAL_END:
+        current->pos = sb_chars(current->buf);
+        refreshCursor(current);
+        break;
+    case ctrl('U'): /* Ctrl+u, delete to beginning of line, save deleted chars. */
+        if (remove_chars(current, 0, current->pos)) {
+            refreshLine(current);
+        }
+        break;
+    case ctrl('K'): /* Ctrl+k, delete from current to end of line, save deleted chars. */
+        if (remove_chars(current, current->pos, sb_chars(current->buf) - current->pos)) {
+            refreshLine(current);
+        }
+        break;
+    case ctrl('Y'): /* Ctrl+y, insert saved chars at current position */
+        if (current->capture && insert_chars(current, current->pos, sb_str(current->capture))) {
             refreshLine(current);
+        }
+        break;
+#ifdef USE_TERMIOS
+    case SPECIAL_PASTE: /* bracketed paste: insert it all at once */
+        current->paste = tmp_sb_alloc(current);
+        current->pasteprev = 0;
+        current->mode = EDIT_PASTE;
+        break;
+#endif
+    case ctrl('L'): /* Ctrl+L, clear screen */
+        linenoiseClearScreen();
+        /* Force recalc of window size for serial terminals */
+        current->cols = 0;
+        current->rpos = 0;
+        screenInvalidate(current);
+        refreshLine(current);
+        break;
+    default:
+        if (c >= meta('a') && c <= meta('z')) {
+            /* Don't insert meta chars that are not bound */
             break;
-        default:
-            if (c >= meta('a') && c <= meta('z')) {
-                /* Don't insert meta chars that are not bound */
-                break;
-            }
+        }
 
 						if (c >= ' ' && c < 256 && characterCallback[c]) {
-							int rcode = characterCallback[c](current->buf, current->pos, c);
+							int rcode;
+							/* Show the line as it is before the callback produces any output */
+							refreshPending(current);
+							rcode = characterCallback[c](current->buf, current->pos, c);
+							/* The callback may have produced output */
+							screenInvalidate(current);
 							refreshLine(current);
 							if (rcode == 1) {
-								continue;
+								break;
 							}
 						}
 
 						/* Only tab is allowed without ^V */
-            if (c == '\t' || c >= ' ') {
-                if (insert_char(current, current->pos, c) == 1) {
-                    refreshLine(current);
+        if (c == '\t' || c >= ' ') {
+            if (insert_typed(current, current->pos, c, 1)) {
+#ifdef USE_TERMIOS
+                /* If more plain chars have already arrived, as when text is
+                 * pasted without bracketed paste mode, insert them all at once.
+                 */
+                char buf[256 + MAX_UTF8_LEN];
+                int n;
+
+                while ((n = input_plain(current, buf, 256)) > 0) {
+                    buf[n] = 0;
+                    insert_string(current, current->pos, buf, 1);
                 }
+#endif
+                refreshLine(current);
             }
-            break;
         }
+        break;
+    }
+    return LINENOISE_EDIT_MORE;
+}
+
+/**
+ * Processes input for the line being edited until the line is complete or,
+ * unless 'block' is set, until the input that has already arrived is used up.
+ *
+ * Returns LINENOISE_EDIT_MORE, LINENOISE_EDIT_DONE or LINENOISE_EDIT_EOF
+ * as for linenoiseEditKey().
+ */
+static int linenoiseEditInput(struct current *current, int block)
+{
+    while (1) {
+        int ret;
+
+        if (current->refreshpending && !fd_input_pending(current)) {
+            /* Caught up with the input, so show the result */
+            refreshPending(current);
+        }
+#ifdef USE_TERMIOS
+        if (current->mode == EDIT_PASTE) {
+            if (readPaste(current, block ? -1 : 0) == 0) {
+                return LINENOISE_EDIT_MORE;
+            }
+            pasteEnd(current);
+            continue;
+        }
+#endif
+        if (!block && !fd_char_ready(current)) {
+            /* Show the result of what has been read so far */
+            refreshPending(current);
+            return LINENOISE_EDIT_MORE;
+        }
+        ret = linenoiseEditKey(current, fd_read(current));
+        if (ret != LINENOISE_EDIT_MORE) {
+            return ret;
+        }
+    }
+}
+
+/**
+ * Starts editing the line in 'current', which must be in raw mode,
+ * with the given prompt and initial contents.
+ */
+static void linenoiseEditBegin(struct current *current, const char *prompt, const char *initial)
+{
+    current->buf = sb_alloc();
+    current->pos = 0;
+    current->nrows = 1;
+    current->prompt = prompt;
+
+    /* The latest history entry is always our current buffer */
+    linenoiseHistoryAdd(initial);
+    set_current(current, initial);
+
+    history_index = 0;
+
+    refreshLine(current);
+}
+
+/**
+ * Finishes editing the line in 'current', leaving raw mode and freeing
+ * everything but current->buf.
+ */
+static void linenoiseEditEnd(struct current *current)
+{
+    editModeEnd(current);
+    refreshPending(current);
+
+    endRawMode(current);
+    printf("\n");
+
+    screenFree(current);
+    linecacheFree(current);
+#ifndef NO_COMPLETION
+    hintcacheFree(current);
+#endif
+    promptlayoutFree(current);
+    sb_free(current->outbuf);
+    sb_free(current->capture);
+    arenaRelease(&current->arena);
+    memset(&current->undo, 0, sizeof(current->undo));
+}
+
+static int linenoiseEdit(struct current *current) {
+    if (linenoiseEditInput(current, 1) == LINENOISE_EDIT_EOF) {
+        return -1;
     }
     return sb_len(current->buf);
 }
@@ -1934,10 +4748,17 @@ static int linenoiseEdit(struct current *current) {
 int linenoiseColumns(void)
 {
     struct current current = {0};
+#ifdef USE_TERMIOS
+    /* Usually the tty knows the width, and raw mode is not needed */
+    int cols = getWindowCols();
+    if (cols) {
+        return cols;
+    }
+#endif
     current.output = NULL;
     enableRawMode (&current);
     getWindowSize (&current);
-    disableRawMode (&current);
+    endRawMode (&current);
     return current.cols;
 }
 
@@ -2020,21 +4841,11 @@ char *linenoiseWithInitial(const char *prompt, const char *initial)
         }
     }
     else {
-        current.buf = sb_alloc();
-        current.pos = 0;
-        current.nrows = 1;
-        current.prompt = prompt;
-
-        /* The latest history entry is always our current buffer */
-        linenoiseHistoryAdd(initial);
-        set_current(&current, initial);
+        linenoiseEditBegin(&current, prompt, initial);
 
         count = linenoiseEdit(&current);
 
-        disableRawMode(&current);
-        printf("\n");
-
-        sb_free(current.capture);
+        linenoiseEditEnd(&current);
         if (count == -1) {
             sb_free(current.buf);
             return NULL;
@@ -2044,6 +4855,64 @@ char *linenoiseWithInitial(const char *prompt, const char *initial)
     return sb ? sb_to_string(sb) : NULL;
 }
 
+/* An edit session driven by the caller's event loop */
+struct linenoiseEditState {
+    struct current current;
+    int result;     /* LINENOISE_EDIT_MORE until the line is complete */
+};
+
+struct linenoiseEditState *linenoiseEditStart(const char *prompt, const char *initial)
+{
+    struct linenoiseEditState *state = (struct linenoiseEditState *)ln_calloc(sizeof(*state));
+
+    if (enableRawMode(&state->current) == -1) {
+        ln_free(state);
+        return NULL;
+    }
+    linenoiseEditBegin(&state->current, prompt, initial);
+    return state;
+}
+
+int linenoiseEditFeed(struct linenoiseEditState *state, char **line)
+{
+    struct current *current = &state->current;
+
+    *line = NULL;
+    if (state->result != LINENOISE_EDIT_MORE) {
+        return state->result;
+    }
+#ifdef USE_TERMIOS
+    if (window_changed) {
+        refreshResized(current);
+    }
+    if (fd_fill(current, 0, INPUT_BUF_RESERVE) < 0) {
+        /* EOF or error */
+        state->result = linenoiseEditKey(current, -1);
+    }
+    else
+#endif
+    {
+        state->result = linenoiseEditInput(current, 0);
+    }
+    if (state->result == LINENOISE_EDIT_DONE) {
+        *line = ln_strdup(sb_str(current->buf));
+    }
+    return state->result;
+}
+
+void linenoiseEditStop(struct linenoiseEditState *state)
+{
+    if (state) {
+        if (state->result == LINENOISE_EDIT_MORE) {
+            /* The line is abandoned, so remove it from the history */
+            history_drop_last();
+        }
+        linenoiseEditEnd(&state->current);
+        sb_free(state->current.buf);
+        ln_free(state);
+    }
+}
+
 char *linenoise(const char *prompt)
 {
     return linenoiseWithInitial(prompt, "");
@@ -2056,48 +4925,81 @@ void linenoiseSetCharacterCallback(linenoiseCharacterCallback *fn, int c) {
     characterCallback[c] = fn;
 }
 
-/* Using a circular buffer is smarter, but a bit more complex to handle. */
-static int linenoiseHistoryAddAllocated(char *line) {
+/**
+ * Makes room for more history entries, up to history_max_len.
+ *
+ * Returns 0 if no more memory could be allocated.
+ */
+static int history_grow(void)
+{
+    int newalloc = history_alloc ? history_alloc * 2 : 16;
+    struct historyslot *newhistory;
 
-    if (history_max_len == 0) {
-notinserted:
-        free(line);
+    if (newalloc > history_max_len) {
+        newalloc = history_max_len;
+    }
+    newhistory = (struct historyslot *)ln_realloc(history, sizeof(*history) * newalloc);
+    if (newhistory == NULL) {
         return 0;
     }
+    history = newhistory;
+    if (history_start) {
+        /* The entries from history_start to the end of the old slots move
+         * to the end of the new ones, so that the entries stay in order. */
+        int tomove = history_alloc - history_start;
+
+        memmove(history + newalloc - tomove, history + history_start, sizeof(*history) * tomove);
+        history_start = newalloc - tomove;
+    }
+    history_alloc = newalloc;
+    return 1;
+}
 
-    if (line == NULL)
-        goto notinserted;
+/* Adds the first 'len' bytes of 'line' to the history */
+static int history_add(const char *line, int len) {
+    struct historyslot *slot;
+    int offset;
 
-    if (history == NULL) {
-        history = (char **)calloc(sizeof(char*), history_max_len);
-        if (history == NULL)
-            goto notinserted;
+    if (history_max_len == 0 || line == NULL) {
+        return 0;
     }
 
     /* do not insert duplicate lines into history */
-    if (history_len > 0 && strcmp(line, history[history_len - 1]) == 0) {
-        goto notinserted;
+    if (history_len > 0) {
+        slot = history_entry(history_len - 1);
+        if (slot->len == len && memcmp(line, history_text + slot->offset, len) == 0) {
+            return 0;
+        }
     }
 
     if (history_len == history_max_len) {
-        free(history[0]);
-        memmove(history,history+1,sizeof(char*)*(history_max_len-1));
-        history_len--;
+        /* Drop the oldest entry, and reuse its slot */
+        history_drop_first();
+    }
+    else if (history_len == history_alloc && !history_grow()) {
+        return 0;
     }
-    history[history_len] = line;
+    offset = history_store(line, len);
+    if (offset < 0) {
+        return 0;
+    }
+    slot = history_entry(history_len);
+    slot->offset = offset;
+    slot->len = len;
     history_len++;
+    history_compact();
     return 1;
 }
 
 /* This is the API call to add a new entry in the linenoise history.
- * It uses a fixed array of char pointers that are shifted (memmoved)
- * when the history max length is reached in order to remove the older
- * entry and make room for the new one, so it is not exactly suitable for huge
- * histories, but will work well for a few hundred of entries.
- *
- * Using a circular buffer is smarter, but a bit more complex to handle. */
+ * The history is a circular buffer, so once the history max length is reached
+ * the oldest entry is dropped to make room for the new one without moving
+ * the rest. */
 int linenoiseHistoryAdd(const char *line) {
-    return linenoiseHistoryAddAllocated(strdup(line));
+    if (line == NULL) {
+        return 0;
+    }
+    return history_add(line, strlen(line));
 }
 
 int linenoiseHistoryGetMaxLen(void) {
@@ -2105,30 +5007,15 @@ int linenoiseHistoryGetMaxLen(void) {
 }
 
 int linenoiseHistorySetMaxLen(int len) {
-    char **newHistory;
-
     if (len < 1) return 0;
-    if (history) {
-        int tocopy = history_len;
-
-        newHistory = (char **)malloc(sizeof(char*)*len);
-        if (newHistory == NULL) return 0;
-		
-        /* If we can't copy everything, free the elements we'll not use. */
-        if (len < tocopy) {
-            int j;
 
-            for (j = 0; j < tocopy - len; j++) 
-				free(history[j]);
-            tocopy = len;
-        }
-        memcpy(newHistory, history+(history_max_len-tocopy), sizeof(char*)*tocopy);
-        free(history);
-        history = newHistory;
+    /* Drop the oldest entries that no longer fit. The slots are kept,
+     * and the buffer only grows up to the new length from now on. */
+    while (history_len > len) {
+        history_drop_first();
     }
     history_max_len = len;
-    if (history_len > history_max_len)
-        history_len = history_max_len;
+    history_compact();
     return 1;
 }
 
@@ -2140,7 +5027,7 @@ int linenoiseHistorySave(const char *filename) {
 
     if (fp == NULL) return -1;
     for (j = 0; j < history_len; j++) {
-        const char *str = history[j];
+        const char *str = history_str(j);
         /* Need to encode backslash, nl and cr */
         while (*str) {
             if (*str == '\\') {
@@ -2177,11 +5064,16 @@ int linenoiseHistoryLoad(const char *filename) {
     if (fp == NULL) return -1;
 
     while ((sb = sb_getline(fp)) != NULL) {
-        /* Take the stringbuf and decode backslash escaped values */
-        char *buf = sb_to_string(sb);
-        char *dest = buf;
+        /* Decode backslash escaped values in place */
+        char *buf = sb_str(sb);
+        char *dest;
         const char *src;
 
+        if (buf == NULL) {
+            sb_free(sb);
+            continue;
+        }
+
         /* Decode backslash escaped values */
         for (src = dest = buf; *src; src++) {
             char ch = *src;
@@ -2205,7 +5097,8 @@ int linenoiseHistoryLoad(const char *filename) {
         }
         *dest = 0;
 
-        linenoiseHistoryAddAllocated(buf);
+        history_add(buf, dest - buf);
+        sb_free(sb);
     }
     fclose(fp);
     return 0;
@@ -2219,5 +5112,25 @@ char **linenoiseHistory(int *len) {
     if (len) {
         *len = history_len;
     }
-    return history;
+    if (history == NULL) {
+        return NULL;
+    }
+    /* A list of pointers to the entries, made when it is asked for */
+    history_list = (char **)ln_realloc(history_list, sizeof(char *) * (history_alloc + 1));
+    if (history_list) {
+        int j;
+
+        for (j = 0; j < history_len; j++) {
+            history_list[j] = history_str(j);
+        }
+        history_list[j] = NULL;
+    }
+    return history_list;
+}
+
+const char *linenoiseHistoryGet(int n) {
+    if (n < 0 || n >= history_len) {
+        return NULL;
+    }
+    return history_str(n);
 }
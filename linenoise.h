@@ -68,6 +68,13 @@ linenoiseCompletionCallback * linenoiseSetCompletionCallback(linenoiseCompletion
  */
 void linenoiseAddCompletion(linenoiseCompletions *comp, const char *str);
 
+/*
+ * The callback type for hints shown to the right of the line being edited.
+ *
+ * The callback is called once for each change to the line, and the hint returned
+ * is shown again until the line changes, so it must remain valid until it is
+ * passed to the linenoiseFreeHintsCallback (if any).
+ */
 typedef char*(linenoiseHintsCallback)(const char *, int *color, int *bold, void *userdata);
 typedef void(linenoiseFreeHintsCallback)(void *hint, void *userdata);
 void linenoiseSetHintsCallback(linenoiseHintsCallback *callback, void *userdata);
@@ -92,6 +99,67 @@ char *linenoise(const char *prompt);
  */
 char *linenoiseWithInitial(const char *prompt, const char *initial);
 
+/*
+ * For editing a line from the application's own event loop, instead of
+ * blocking in linenoise():
+ *
+ *   struct linenoiseEditState *es = linenoiseEditStart("> ", "");
+ *   ... whenever stdin is readable:
+ *   char *line;
+ *   switch (linenoiseEditFeed(es, &line)) { ... }
+ *   ... once the line is complete or no longer wanted:
+ *   linenoiseEditStop(es);
+ *
+ * The terminal is in raw mode from start to stop, so the application should
+ * not write to it in between. Only one line can be edited at a time.
+ */
+struct linenoiseEditState;
+
+/* Results of linenoiseEditFeed() */
+#define LINENOISE_EDIT_MORE 0   /* still editing */
+#define LINENOISE_EDIT_DONE 1   /* the line is complete (ENTER, or the input was closed) */
+#define LINENOISE_EDIT_EOF -1   /* EOF (ctrl-D on an empty line), or ctrl-C with errno set to EAGAIN */
+
+/**
+ * Starts editing a line with the given prompt and initial contents, and shows it.
+ *
+ * Returns NULL if stdin is not a terminal that linenoise supports, in which
+ * case the application should read the line itself.
+ */
+struct linenoiseEditState *linenoiseEditStart(const char *prompt, const char *initial);
+
+/**
+ * Processes whatever input has arrived, without waiting for more, apart from
+ * the escape timeout after a lone ESC (see linenoiseSetEscapeTimeout()).
+ * Call it when stdin is readable, and also once straight after
+ * linenoiseEditStart() since keys may have been typed ahead.
+ * A change in the window size is dealt with on the next call.
+ *
+ * Returns one of the LINENOISE_EDIT_xxx results. For LINENOISE_EDIT_DONE,
+ * *line is set to a copy of the line, which the caller must free().
+ * Otherwise *line is set to NULL.
+ */
+int linenoiseEditFeed(struct linenoiseEditState *state, char **line);
+
+/**
+ * Ends the edit, leaving raw mode, and frees 'state'.
+ * If the line was not complete, it is abandoned.
+ */
+void linenoiseEditStop(struct linenoiseEditState *state);
+
+/**
+ * Makes linenoise allocate memory with the given functions rather than with
+ * malloc(), realloc() and free(), or with those again if any of them is NULL.
+ *
+ * Call this before anything else that allocates, e.g. loading the history.
+ * The lines returned by linenoise() and linenoiseEditFeed() are then
+ * allocated with these functions, so must be freed with 'freefn'.
+ *
+ * The memory used while a line is edited comes from blocks that are all freed
+ * together when the edit ends.
+ */
+void linenoiseSetAllocator(void *(*mallocfn)(size_t), void *(*reallocfn)(void *, size_t), void (*freefn)(void *));
+
 /**
  * Clear the screen.
  */
@@ -133,12 +201,21 @@ int linenoiseHistoryLoad(const char *filename);
 void linenoiseHistoryFree(void);
 
 /*
- * Returns a pointer to the list of history entries, writing its
+ * Returns a pointer to the list of history entries, oldest first, writing its
  * length to *len if len is not NULL. The memory is owned by linenoise
- * and must not be freed.
+ * and must not be freed. The list is only valid until the history is next
+ * changed, and is made each time this is called, so linenoiseHistoryGet()
+ * is better for looking at a few entries.
  */
 char **linenoiseHistory(int *len);
 
+/*
+ * Returns history entry 'n', where 0 is the oldest, or NULL if there is no
+ * such entry. The string is owned by linenoise and must not be freed, and is
+ * only valid until the history is next changed.
+ */
+const char *linenoiseHistoryGet(int n);
+
 /*
  * Returns the number of display columns in the current terminal.
  */
@@ -149,6 +226,77 @@ int linenoiseColumns(void);
  */
 void linenoiseSetMultiLine(int enableml);
 
+/**
+ * When keys arrive faster than the line can be redrawn, e.g. when text is
+ * pasted, the line is redrawn once the input has been processed rather than
+ * after every key, but at least every 'ms' milliseconds.
+ * A value of 0 redraws after every key. The default is 50ms.
+ */
+void linenoiseSetMaxRefreshDelay(int ms);
+
+/**
+ * Makes the key sequence 'seq' sent by the terminal, which must start with ESC,
+ * act as 'key'. 'key' is a character code as typed, e.g. 16 for ctrl-P, or -c
+ * for meta-c (ESC c). e.g. linenoiseAddKeySequence("\x1b[1;5A", 16) makes ctrl-up
+ * go back through the history. Any existing entry for 'seq' is replaced.
+ *
+ * Returns 0 if OK, or -1 if 'seq' is not valid.
+ */
+int linenoiseAddKeySequence(const char *seq, int key);
+
+/**
+ * Sets how long to wait after ESC for the rest of a key sequence before taking
+ * it as the escape key on its own. The default is 50ms.
+ * Sequences that arrive all at once are decoded without waiting.
+ */
+void linenoiseSetEscapeTimeout(int ms);
+
+/**
+ * Sets the characters that separate words for meta-b, meta-f and ctrl-W,
+ * replacing the default of just space. e.g. " /.-_" stops at parts of paths too.
+ * Only characters below 256 can be given.
+ */
+void linenoiseSetWordBreakChars(const char *chars);
+
+/**
+ * With 'enable' set, the terminal is left in raw mode at the end of each line,
+ * ready for the next, rather than being restored (disabled by default).
+ * Keys typed while the application deals with the line are then neither echoed
+ * nor lost, but ctrl-C and ctrl-Z do not send signals in the meantime.
+ * Output with printf() etc. still works as usual. The terminal is restored when
+ * this is disabled again, and at exit.
+ */
+void linenoiseSetKeepRawMode(int enable);
+
+/*
+ * A session sets up the terminal once for any number of lines, rather than
+ * for each line. The checks that the terminal is usable are not repeated,
+ * and it stays in raw mode between lines, as with linenoiseSetKeepRawMode().
+ * Only one session can be open at a time.
+ */
+struct linenoiseSession;
+
+/**
+ * Opens a session, and puts the terminal in raw mode.
+ *
+ * Returns NULL if stdin is not a terminal that linenoise supports,
+ * or if a session is already open.
+ */
+struct linenoiseSession *linenoiseSessionOpen(void);
+
+/**
+ * Restores the terminal until the next line, e.g. before the application
+ * writes output that needs the usual terminal settings, or runs another program.
+ * Only the terminal mode is set again for the next line.
+ */
+void linenoiseSessionSuspend(struct linenoiseSession *session);
+
+/**
+ * Closes the session, and restores the terminal unless
+ * linenoiseSetKeepRawMode() was enabled beforehand.
+ */
+void linenoiseSessionClose(struct linenoiseSession *session);
+
 void linenoisePrintKeyCodes(void);
 
 #ifdef __cplusplus
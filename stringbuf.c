@@ -20,17 +20,60 @@
 #endif
 #endif
 
-#define SB_INCREMENT 200
+
+#ifdef USE_UTF8
+/* sb_index() records the byte index of every SB_INDEX_STEP'th char it passes */
+#define SB_INDEX_STEP 64
+#endif
+
+static void *sb_default_realloc(void *userdata, void *ptr, size_t size)
+{
+	(void)userdata;
+	if (size == 0) {
+		free(ptr);
+		return NULL;
+	}
+	return realloc(ptr, size);
+}
+
+static const sb_allocator sb_default_allocator = { sb_default_realloc, NULL };
+
+/* The allocator for sb_alloc() */
+static const sb_allocator *sb_allocator_used = &sb_default_allocator;
+
+/**
+ * Allocates, resizes or (if 'size' is 0) frees 'ptr' with 'alloc'.
+ */
+static void *sb_mem(const sb_allocator *alloc, void *ptr, size_t size)
+{
+	return alloc->reallocfn(alloc->userdata, ptr, size);
+}
+
+void sb_set_allocator(const sb_allocator *alloc)
+{
+	sb_allocator_used = alloc ? alloc : &sb_default_allocator;
+}
 
 stringbuf *sb_alloc(void)
 {
-	stringbuf *sb = (stringbuf *)malloc(sizeof(*sb));
+	return sb_alloc_from(sb_allocator_used);
+}
+
+stringbuf *sb_alloc_from(const sb_allocator *alloc)
+{
+	stringbuf *sb = (stringbuf *)sb_mem(alloc, NULL, sizeof(*sb));
+	sb->alloc = alloc;
 	sb->remaining = 0;
 	sb->last = 0;
+	sb->gap = 0;
 #ifdef USE_UTF8
 	sb->chars = 0;
+	sb->charindex = NULL;
+	sb->nindex = 0;
+	sb->indexalloc = 0;
 #endif
 	sb->data = NULL;
+	sb->revision = 0;
 
 	return(sb);
 }
@@ -38,15 +81,121 @@ stringbuf *sb_alloc(void)
 void sb_free(stringbuf *sb)
 {
 	if (sb) {
-		free(sb->data);
+		if (sb->data != sb->small) {
+			sb_mem(sb->alloc, sb->data, 0);
+		}
+#ifdef USE_UTF8
+		sb_mem(sb->alloc, sb->charindex, 0);
+#endif
+		sb_mem(sb->alloc, sb, 0);
 	}
-	free(sb);
 }
 
+/* The unused space (the gap) is kept at 'gap' rather than at the end, so that
+ * insertions and deletions where the last one was made move little data.
+ *
+ * The bytes before the gap are data[0 .. gap) and those after it are
+ * data[gap + remaining .. last + remaining). data[gap] is 0 whenever there
+ * is a gap, and so is the byte after all of that, so both parts can be read
+ * as utf-8. With no gap, data[gap] is the first byte after it instead.
+ */
+
+/**
+ * Resizes the buffer so that 'newlen' bytes are available in total,
+ * keeping the bytes after the gap at the end.
+ *
+ * If they fit, the bytes are kept in sb->small rather than allocated.
+ * The buffer can only be made smaller with the gap at the end.
+ */
 static void sb_realloc(stringbuf *sb, int newlen)
 {
-	sb->data = (char *)realloc(sb->data, newlen);
-	sb->remaining = newlen - sb->last;
+	int after = sb->last - sb->gap;
+	int remaining;
+
+	if (newlen < SB_INLINE) {
+		newlen = SB_INLINE - 1;
+		if (sb->data && sb->data != sb->small) {
+			memcpy(sb->small, sb->data, sb->last + 1);
+			sb_mem(sb->alloc, sb->data, 0);
+		}
+		sb->data = sb->small;
+	}
+	else if (sb->data == sb->small) {
+		sb->data = (char *)sb_mem(sb->alloc, NULL, newlen + 1);
+		memcpy(sb->data, sb->small, SB_INLINE);
+	}
+	else {
+		sb->data = (char *)sb_mem(sb->alloc, sb->data, newlen + 1);
+	}
+	remaining = newlen - sb->last;
+	assert(after == 0 || remaining >= sb->remaining);
+
+	if (after) {
+		memmove(sb->data + sb->gap + remaining, sb->data + sb->gap + sb->remaining, after);
+	}
+	sb->remaining = remaining;
+	if (remaining) {
+		sb->data[sb->gap] = 0;
+	}
+	sb->data[newlen] = 0;
+}
+
+/**
+ * Makes sure that there is room for 'len' more bytes, growing the
+ * buffer by at least half again so that a run of appends is cheap.
+ */
+static void sb_grow(stringbuf *sb, int len)
+{
+	/* One byte more, for the 0 at the gap */
+	if (sb->remaining < len + 1) {
+		int newlen = sb->last + sb->remaining;
+
+		newlen += newlen / 2;
+		if (newlen < sb->last + len + 1) {
+			newlen = sb->last + len + 1;
+		}
+		sb_realloc(sb, newlen);
+	}
+}
+
+/**
+ * Moves the gap to byte 'pos' of the string.
+ */
+static void sb_move_gap(stringbuf *sb, int pos)
+{
+	assert(pos <= sb->last);
+
+	if (pos < sb->gap) {
+		/* Move the bytes from pos up to the gap after it */
+		memmove(sb->data + pos + sb->remaining, sb->data + pos, sb->gap - pos);
+	}
+	else if (pos > sb->gap) {
+		/* Move the bytes from after the gap up to pos before it */
+		memmove(sb->data + sb->gap, sb->data + sb->gap + sb->remaining, pos - sb->gap);
+	}
+	else {
+		return;
+	}
+	sb->gap = pos;
+	if (sb->remaining) {
+		/* Otherwise this is the byte after the gap, which must be kept */
+		sb->data[sb->gap] = 0;
+	}
+}
+
+void sb_reserve(stringbuf *sb, int len)
+{
+	if (sb->last + sb->remaining < len + 1) {
+		sb_realloc(sb, len + 1);
+	}
+}
+
+void sb_shrink(stringbuf *sb)
+{
+	if (sb->data) {
+		sb_move_gap(sb, sb->last);
+		sb_realloc(sb, sb->last);
+	}
 }
 
 void sb_append(stringbuf *sb, const char *str)
@@ -56,88 +205,251 @@ void sb_append(stringbuf *sb, const char *str)
 
 void sb_append_len(stringbuf *sb, const char *str, int len)
 {
-	if (sb->remaining < len + 1) {
-		sb_realloc(sb, sb->last + len + 1 + SB_INCREMENT);
-	}
+	sb_move_gap(sb, sb->last);
+	sb_grow(sb, len);
 	memcpy(sb->data + sb->last, str, len);
 	sb->data[sb->last + len] = 0;
 
 	sb->last += len;
+	sb->gap = sb->last;
 	sb->remaining -= len;
+	sb->revision++;
 #ifdef USE_UTF8
 	sb->chars += utf8_strlen(str, len);
 #endif
 }
 
-char *sb_to_string(stringbuf *sb)
+char *sb_str(stringbuf *sb)
 {
-	if (sb->data == NULL) {
-		/* Return an allocated empty string, not null */
-		return strdup("");
+	/* The string must be in one piece */
+	sb_move_gap(sb, sb->last);
+	return sb->data;
+}
+
+const char *sb_part(stringbuf *sb, int index)
+{
+	assert(index >= 0 && index <= sb->last);
+
+	if (!sb->data) {
+		return "";
 	}
-	else {
-		/* Just return the data and free the stringbuf structure */
-		char *pt = sb->data;
-		free(sb);
-		return pt;
+	if (index >= sb->gap) {
+		index += sb->remaining;
 	}
+	return sb->data + index;
 }
 
-/* Insert and delete operations */
+/**
+ * Decodes the char at byte index 'i' into *c and returns its length in bytes.
+ */
+static int sb_decode(stringbuf *sb, int i, int *c)
+{
+	if (i >= sb->gap) {
+		i += sb->remaining;
+	}
+	/* A char before the gap can't run into it, since data[gap] is 0 */
+#ifdef USE_UTF8
+	return utf8_tounicode(sb->data + i, c);
+#else
+	*c = (unsigned char)sb->data[i];
+	return 1;
+#endif
+}
 
-/* Moves up all the data at position 'pos' and beyond by 'len' bytes
- * to make room for new data
- *
- * Note: Does *not* update sb->chars
+#ifdef USE_UTF8
+/**
+ * Returns the byte index of the char after the one at byte index 'i'.
  */
-static void sb_insert_space(stringbuf *sb, int pos, int len)
+static int sb_next(stringbuf *sb, int i)
 {
-	assert(pos <= sb->last);
+	int c;
 
-	/* Make sure there is enough space */
-	if (sb->remaining < len) {
-		sb_realloc(sb, sb->last + len + SB_INCREMENT);
-	}
-	/* Now move it up */
-	memmove(sb->data + pos + len, sb->data + pos, sb->last - pos);
-	sb->last += len;
-	sb->remaining -= len;
-	/* And null terminate */
-	sb->data[sb->last] = 0;
+	return i + sb_decode(sb, i, &c);
 }
 
 /**
- * Move down all the data from pos + len, effectively
- * deleting the data at position 'pos' of length 'len'
+ * Forgets the recorded byte indexes after byte 'pos', since
+ * the chars there are about to change.
  */
-static void sb_delete_space(stringbuf *sb, int pos, int len)
+static void sb_index_truncate(stringbuf *sb, int pos)
+{
+	int lo = 0;
+	int hi = sb->nindex;
+
+	/* Keep the entries <= pos */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (sb->charindex[mid] <= pos) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	sb->nindex = lo;
+}
+#endif
+
+int sb_index(stringbuf *sb, int pos)
+{
+#ifdef USE_UTF8
+	int n;
+	int i;
+
+	if (pos >= sb->chars) {
+		return sb->last;
+	}
+	if (pos <= 0) {
+		return 0;
+	}
+	n = pos / SB_INDEX_STEP;
+	if (n >= sb->nindex) {
+		/* Step on from the last entry known, recording more */
+		if (sb->nindex == 0) {
+			sb->indexalloc = 16;
+			sb->charindex = (int *)sb_mem(sb->alloc, sb->charindex, sb->indexalloc * sizeof(*sb->charindex));
+			sb->charindex[sb->nindex++] = 0;
+		}
+		i = sb->charindex[sb->nindex - 1];
+		while (sb->nindex <= n) {
+			int j;
+
+			for (j = 0; j < SB_INDEX_STEP && i < sb->last; j++) {
+				i = sb_next(sb, i);
+			}
+			if (sb->nindex == sb->indexalloc) {
+				sb->indexalloc *= 2;
+				sb->charindex = (int *)sb_mem(sb->alloc, sb->charindex, sb->indexalloc * sizeof(*sb->charindex));
+			}
+			sb->charindex[sb->nindex++] = i;
+		}
+	}
+	i = sb->charindex[n];
+	for (pos -= n * SB_INDEX_STEP; pos > 0 && i < sb->last; pos--) {
+		i = sb_next(sb, i);
+	}
+	return i;
+#else
+	return pos < sb->last ? pos : sb->last;
+#endif
+}
+
+void sb_iter_init(sb_iter *it, stringbuf *sb, int pos)
+{
+	if (pos < 0) {
+		pos = 0;
+	}
+	else if (pos > sb_chars(sb)) {
+		pos = sb_chars(sb);
+	}
+	it->sb = sb;
+	it->pos = pos;
+	it->index = sb_index(sb, pos);
+}
+
+int sb_iter_next(sb_iter *it)
+{
+	int c;
+
+	if (it->index >= it->sb->last) {
+		return -1;
+	}
+	it->index += sb_decode(it->sb, it->index, &c);
+	it->pos++;
+	return c;
+}
+
+int sb_iter_prev(sb_iter *it)
 {
-	assert(pos < sb->last);
-	assert(pos + len <= sb->last);
+	int c;
+	int n = 1;
 
+	if (it->index <= 0) {
+		return -1;
+	}
 #ifdef USE_UTF8
-	sb->chars -= utf8_strlen(sb->data + pos, len);
+	/* The longest char that ends here is the one stepping forward would find */
+	for (n = (it->index < MAX_UTF8_LEN) ? it->index : MAX_UTF8_LEN; n > 1; n--) {
+		if (sb_decode(it->sb, it->index - n, &c) == n) {
+			break;
+		}
+	}
 #endif
+	sb_decode(it->sb, it->index - n, &c);
+	it->index -= n;
+	it->pos--;
+	return c;
+}
+
+void sb_append_part(stringbuf *sb, stringbuf *from, int index, int len)
+{
+	assert(sb != from);
+
+	if (index + len > from->last) {
+		len = from->last - index;
+	}
+	if (len <= 0) {
+		return;
+	}
+	if (index < from->gap) {
+		/* The part before the gap */
+		int n = (index + len < from->gap) ? len : from->gap - index;
+
+		sb_append_len(sb, from->data + index, n);
+		index += n;
+		len -= n;
+	}
+	if (len > 0) {
+		sb_append_len(sb, from->data + from->remaining + index, len);
+	}
+}
+
+char *sb_to_string(stringbuf *sb)
+{
+	const sb_allocator *alloc = sb->alloc;
+	char *pt = sb_str(sb);
 
-	/* Now move it up */
-	memmove(sb->data + pos, sb->data + pos + len, sb->last - pos - len);
-	sb->last -= len;
-	sb->remaining += len;
-	/* And null terminate */
-	sb->data[sb->last] = 0;
+	if (pt == NULL || pt == sb->small) {
+		/* Return an allocated copy, and an empty string rather than null */
+		char *copy = (char *)sb_mem(alloc, NULL, sb->last + 1);
+
+		memcpy(copy, pt ? pt : "", sb->last + 1);
+		pt = copy;
+	}
+	/* Otherwise just return the data and free the stringbuf structure */
+#ifdef USE_UTF8
+	sb_mem(alloc, sb->charindex, 0);
+#endif
+	sb_mem(alloc, sb, 0);
+	return pt;
 }
 
+/* Insert and delete operations */
+
 void sb_insert(stringbuf *sb, int index, const char *str)
+{
+	sb_insert_len(sb, index, str, strlen(str));
+}
+
+void sb_insert_len(stringbuf *sb, int index, const char *str, int len)
 {
 	if (index >= sb->last) {
 		/* Inserting after the end of the list appends. */
-		sb_append(sb, str);
+		sb_append_len(sb, str, len);
 	}
 	else {
-		int len = strlen(str);
-
-		sb_insert_space(sb, index, len);
+		/* Make sure there is enough space, then fill the start of the gap */
+		sb_grow(sb, len);
+		sb_move_gap(sb, index);
 		memcpy(sb->data + index, str, len);
+#ifdef USE_UTF8
+		sb_index_truncate(sb, index);
+#endif
+		sb->gap += len;
+		sb->last += len;
+		sb->remaining -= len;
+		sb->data[sb->gap] = 0;
+		sb->revision++;
 #ifdef USE_UTF8
 		sb->chars += utf8_strlen(str, len);
 #endif
@@ -151,12 +463,19 @@ void sb_insert(stringbuf *sb, int index, const char *str)
 void sb_delete(stringbuf *sb, int index, int len)
 {
 	if (index < sb->last) {
-		char *pos = sb->data + index;
-		if (len < 0) {
-			len = sb->last;
+		if (len < 0 || len > sb->last - index) {
+			len = sb->last - index;
 		}
 
-		sb_delete_space(sb, pos - sb->data, len);
+		/* The deleted bytes become part of the gap */
+		sb_move_gap(sb, index);
+#ifdef USE_UTF8
+		sb->chars -= utf8_strlen(sb->data + sb->gap + sb->remaining, len);
+		sb_index_truncate(sb, index);
+#endif
+		sb->last -= len;
+		sb->remaining += len;
+		sb->revision++;
 	}
 }
 
@@ -165,9 +484,13 @@ void sb_clear(stringbuf *sb)
 	if (sb->data) {
 		/* Null terminate */
 		sb->data[0] = 0;
+		sb->remaining += sb->last;
 		sb->last = 0;
+		sb->gap = 0;
 #ifdef USE_UTF8
 		sb->chars = 0;
+		sb->nindex = 0;
 #endif
 	}
+	sb->revision++;
 }
@@ -7,6 +7,8 @@
  *
  * See utf8.c for licence details.
  */
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,7 +16,12 @@ extern "C" {
 /** @file
  * A stringbuf is a resizing, null terminated string buffer.
  *
- * The buffer is reallocated as necessary.
+ * Short strings are kept in the stringbuf itself. Longer ones are allocated,
+ * and the allocation grows by half again each time more room is needed.
+ *
+ * The unused space is kept as a gap where the last insertion or deletion
+ * was made, so a run of edits at or near the same place is cheap even in a
+ * long string. sb_str() closes the gap up again when it is needed.
  *
  * In general it is *not* OK to call these functions with a NULL pointer
  * unless stated otherwise.
@@ -22,17 +29,38 @@ extern "C" {
  * If USE_UTF8 is defined, supports utf8.
  */
 
+/* Strings up to this size (including the null) need no separate allocation */
+#define SB_INLINE 32
+
+/**
+ * Where the memory for a stringbuf comes from.
+ *
+ * 'reallocfn' is called like realloc(ptr, size), except that it
+ * frees 'ptr' if 'size' is 0, and it is also passed 'userdata'.
+ */
+typedef struct sb_allocator {
+	void *(*reallocfn)(void *userdata, void *ptr, size_t size);
+	void *userdata;
+} sb_allocator;
+
 /**
- * The stringbuf structure should not be accessed directly.
+ * The stringbuf structure should not be accessed directly, or copied.
  * Use the functions below.
  */
 typedef struct {
-	int remaining;	/**< Allocated, but unused space */
-	int last;		/**< Index of the null terminator (and thus the length of the string) */
+	int remaining;	/**< Allocated, but unused space (the size of the gap) */
+	int last;		/**< Length of the string */
+	int gap;		/**< Index of the gap in the string, equal to 'last' when it is at the end */
 #ifdef USE_UTF8
 	int chars;		/**< Count of characters */
+	int *charindex;	/**< Byte index of every SB_INDEX_STEP'th character, as far as known */
+	int nindex;		/**< Number of entries known in charindex */
+	int indexalloc;	/**< Number of entries allocated for charindex */
 #endif
-	char *data;		/**< Allocated memory containing the string or NULL for empty */
+	const sb_allocator *alloc;	/**< Where the stringbuf and its data are allocated */
+	char *data;		/**< Allocated memory or 'small' containing the string or NULL for empty */
+	unsigned revision;	/**< Changed by every modification */
+	char small[SB_INLINE];	/**< Storage for short strings */
 } stringbuf;
 
 /**
@@ -40,6 +68,19 @@ typedef struct {
  */
 stringbuf *sb_alloc(void);
 
+/**
+ * Like sb_alloc(), but the stringbuf and its contents are allocated
+ * from 'alloc', which must remain valid until it is freed.
+ */
+stringbuf *sb_alloc_from(const sb_allocator *alloc);
+
+/**
+ * Sets the allocator used by sb_alloc(), or restores the default of
+ * malloc(), realloc() and free() if 'alloc' is NULL.
+ * Existing stringbufs keep the allocator they were allocated from.
+ */
+void sb_set_allocator(const sb_allocator *alloc);
+
 /**
  * Frees a stringbuf.
  * It is OK to call this with NULL.
@@ -73,6 +114,26 @@ static inline int sb_chars(stringbuf *sb) {
 #endif
 }
 
+/**
+ * Returns a number that changes whenever the contents of the buffer are modified
+ * through these functions, so that anything derived from the contents can be
+ * kept until it changes.
+ */
+static inline unsigned sb_revision(const stringbuf *sb) {
+	return sb->revision;
+}
+
+/**
+ * Makes sure that the buffer can hold 'len' bytes in total
+ * without being reallocated.
+ */
+void sb_reserve(stringbuf *sb, int len);
+
+/**
+ * Frees any space the buffer has allocated beyond its current length.
+ */
+void sb_shrink(stringbuf *sb);
+
 /**
  * Appends a null terminated string to the stringbuf
  */
@@ -88,7 +149,11 @@ void sb_append(stringbuf *sb, const char *str);
 void sb_append_len(stringbuf *sb, const char *str, int len);
 
 /**
- * Returns a pointer to the null terminated string in the buffer.
+ * Returns a pointer to the null terminated string in the buffer,
+ * or NULL if nothing has been added.
+ *
+ * If the buffer was last changed before the end, the bytes after the change
+ * are first moved down to close the gap.
  *
  * Note this pointer only remains valid until the next modification to the
  * string buffer.
@@ -96,10 +161,29 @@ void sb_append_len(stringbuf *sb, const char *str, int len);
  * The returned pointer can be used to update the buffer in-place
  * as long as care is taken to not overwrite the end of the buffer.
  */
-static inline char *sb_str(const stringbuf *sb)
-{
-	return sb->data;
-}
+char *sb_str(stringbuf *sb);
+
+/**
+ * Returns a pointer to the bytes from byte 'index' of the buffer, which
+ * run up to a null at the gap or at the end of the string.
+ *
+ * Unlike sb_str(), this leaves any gap in place, so the string can be read
+ * in two parts without moving anything. 'index' must not be past the end.
+ *
+ * Note this pointer only remains valid until the next modification to the
+ * string buffer.
+ */
+const char *sb_part(stringbuf *sb, int index);
+
+/**
+ * Returns the byte index of the utf8 character 'pos' (zero-based),
+ * or the byte length if the buffer is shorter.
+ *
+ * Unlike utf8_index(sb_str(sb), pos), this leaves any gap in place,
+ * and starts from the nearest of the positions already looked up, so it
+ * takes about the same time wherever 'pos' is in the string.
+ */
+int sb_index(stringbuf *sb, int pos);
 
 /**
  * Inserts the given string *before* (zero-based) byte 'index' in the stringbuf.
@@ -108,6 +192,12 @@ static inline char *sb_str(const stringbuf *sb)
  */
 void sb_insert(stringbuf *sb, int index, const char *str);
 
+/**
+ * Like sb_insert() except does not require a null terminated string.
+ * The length of 'str' is given as 'len'
+ */
+void sb_insert_len(stringbuf *sb, int index, const char *str, int len);
+
 /**
  * Delete 'len' bytes in the string at the given index.
  *
@@ -123,8 +213,43 @@ void sb_delete(stringbuf *sb, int index, int len);
  */
 void sb_clear(stringbuf *sb);
 
+/**
+ * Appends the 'len' bytes of 'from' at byte index 'index' to 'sb',
+ * which must be a different stringbuf. Any bytes past the end of
+ * 'from' are ignored.
+ */
+void sb_append_part(stringbuf *sb, stringbuf *from, int index, int len);
+
+/**
+ * Steps through the utf8 characters of a stringbuf from a given position in
+ * either direction. The iterator is only valid until the stringbuf is modified.
+ */
+typedef struct {
+	stringbuf *sb;
+	int pos;		/**< Character position, between the previous character and the next */
+	int index;		/**< Byte index of 'pos' */
+} sb_iter;
+
+/**
+ * Starts 'it' at character position 'pos' of 'sb'.
+ * 'pos' is limited to the start and end of the buffer.
+ */
+void sb_iter_init(sb_iter *it, stringbuf *sb, int pos);
+
+/**
+ * Returns the next character and moves past it, or returns -1 at the end.
+ */
+int sb_iter_next(sb_iter *it);
+
+/**
+ * Moves back before the previous character and returns it,
+ * or returns -1 at the start.
+ */
+int sb_iter_prev(sb_iter *it);
+
 /**
  * Return an allocated copy of buffer and frees 'sb'.
+ * The copy is allocated from the allocator of 'sb'.
  *
  * If 'sb' is empty, returns an allocated copy of "".
  */
@@ -4,7 +4,13 @@
 #include <stdarg.h>
 
 #include <assert.h>
+#ifdef SB_BENCHMARK
+#include <time.h>
+#endif
 #include <stringbuf.h>
+#ifdef USE_UTF8
+#include <utf8.h>
+#endif
 
 static void show_buf(stringbuf *sb)
 {
@@ -18,7 +24,7 @@ static void validate_buf_(const char *file, int line, stringbuf *sb, const char
 	const char *pt = sb_str(sb);
 	if (pt == NULL) {
 		if (expected != NULL) {
-			fprintf(stderr, "%s:%d: Error: Expected NULL, got '%s'\n", file, line, pt);
+			fprintf(stderr, "%s:%d: Error: Expected '%s', got NULL\n", file, line, expected);
 			abort();
 		}
 	}
@@ -30,14 +36,101 @@ static void validate_buf_(const char *file, int line, stringbuf *sb, const char
 	sb_free(sb);
 }
 
+/* An allocator that counts the blocks allocated from it */
+static void *counting_realloc(void *userdata, void *ptr, size_t size)
+{
+	int *count = (int *)userdata;
+
+	if (size == 0) {
+		if (ptr) {
+			(*count)--;
+		}
+		free(ptr);
+		return NULL;
+	}
+	if (ptr == NULL) {
+		(*count)++;
+	}
+	return realloc(ptr, size);
+}
+
+#ifdef SB_BENCHMARK
+static double elapsed(clock_t start)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/**
+ * Prints the time per operation to append, insert and delete a byte
+ * in buffers from 16 bytes up to 'maxsize' bytes.
+ */
+static void benchmark(int maxsize)
+{
+	int size;
+
+	printf("%10s %12s %12s %12s\n", "bytes", "append ns", "insert ns", "delete ns");
+	for (size = 16; size <= maxsize; size *= 4) {
+		/* Fewer operations for the larger sizes, but enough to time */
+		int count = (64 << 20) / size;
+		int rounds = count > 1 ? count : 1;
+		double append = 0;
+		double insert;
+		double delete_;
+		stringbuf *sb = NULL;
+		clock_t start;
+		int i;
+
+		if (count > 10000) {
+			count = 10000;
+		}
+		if (count < 16) {
+			count = 16;
+		}
+
+		/* Build the buffer a byte at a time, from scratch each round */
+		for (i = 0; i < rounds; i++) {
+			int j;
+
+			sb_free(sb);
+			start = clock();
+			sb = sb_alloc();
+			for (j = 0; j < size; j++) {
+				sb_append_len(sb, "x", 1);
+			}
+			append += elapsed(start);
+		}
+		append /= rounds;
+
+		srand(size);
+		start = clock();
+		for (i = 0; i < count; i++) {
+			sb_insert(sb, rand() % sb_len(sb), "y");
+		}
+		insert = elapsed(start);
+
+		start = clock();
+		for (i = 0; i < count; i++) {
+			sb_delete(sb, rand() % sb_len(sb), 1);
+		}
+		delete_ = elapsed(start);
+
+		assert(sb_len(sb) == size);
+		sb_free(sb);
+
+		printf("%10d %12.1f %12.1f %12.1f\n", size, append * 1e9 / size, insert * 1e9 / count, delete_ * 1e9 / count);
+	}
+}
+#endif
+
 #if defined(BUILD_MONOLITHIC)
 #define main      linenoise_test_stringbuf_main
 #endif
 
-int main(void)
+int main(int argc, char *argv[])
 {
 	stringbuf *sb;
 	char *pt;
+	int i;
 
 	sb = sb_alloc();
 	validate_buf(sb, NULL);
@@ -93,6 +186,13 @@ int main(void)
 	sb_insert(sb, 20, "three");
 	validate_buf(sb, "onetwothree");
 
+	sb = sb_alloc();
+	sb_append(sb, "onethree");
+	sb_insert_len(sb, 3, "twofour", 3);
+	sb_insert_len(sb, 11, "four", 0);
+	sb_insert_len(sb, 20, "!?", 1);
+	validate_buf(sb, "onetwothree!");
+
 	sb = sb_alloc();
 	sb_append(sb, "one");
 	sb_append(sb, "extra");
@@ -105,9 +205,8 @@ int main(void)
 	sb_append(sb, "one");
 	sb_append(sb, "two");
 	sb_append(sb, "three");
-	validate_buf(sb, "onetwothree");
-	/*sb_delete(sb, 6, -1);*/
-	/*validate_buf(sb, "onetwo");*/
+	sb_delete(sb, 6, -1);
+	validate_buf(sb, "onetwo");
 
 	sb = sb_alloc();
 	sb_append(sb, "one");
@@ -123,6 +222,161 @@ int main(void)
 	sb_delete(sb, 50, 20);
 	validate_buf(sb, "onetwothree");
 
+	sb = sb_alloc();
+	{
+		unsigned rev = sb_revision(sb);
+		sb_append(sb, "onetwo");
+		assert(sb_revision(sb) != rev);
+		rev = sb_revision(sb);
+		sb_insert(sb, 3, "-");
+		assert(sb_revision(sb) != rev);
+		rev = sb_revision(sb);
+		sb_delete(sb, 3, 1);
+		assert(sb_revision(sb) != rev);
+		rev = sb_revision(sb);
+		(void)sb_str(sb);
+		(void)sb_len(sb);
+		assert(sb_revision(sb) == rev);
+		sb_clear(sb);
+		assert(sb_revision(sb) != rev);
+	}
+	validate_buf(sb, "");
+
+	/* Edits in the middle, with the gap moving both ways */
+	sb = sb_alloc();
+	sb_append(sb, "onethree");
+	sb_insert(sb, 3, "t");
+	sb_insert(sb, 4, "w");
+	sb_insert(sb, 5, "o");
+	assert(sb_len(sb) == 11);
+	sb_insert(sb, 0, "<");
+	sb_delete(sb, 8, 2);
+	sb_insert(sb, 8, "hr");
+	sb_delete(sb, 1, 1);
+	sb_append(sb, ">");
+	validate_buf(sb, "<netwothree>");
+
+	sb = sb_alloc();
+	sb_append(sb, "0123456789");
+	for (i = 0; i < 1000; i++) {
+		sb_insert(sb, 5, "x");
+	}
+	assert(sb_len(sb) == 1010);
+	assert(sb_index(sb, 5) == 5);
+	assert(sb_index(sb, 1009) == 1009);
+	assert(sb_index(sb, 2000) == 1010);
+	pt = sb_str(sb);
+	assert(memcmp(pt, "01234xxx", 8) == 0);
+	assert(strcmp(pt + 1002, "xxx56789") == 0);
+	sb_delete(sb, 5, 1000);
+	validate_buf(sb, "0123456789");
+
+	/* Iterate both ways across the gap, and copy parts spanning it */
+	sb = sb_alloc();
+	sb_append(sb, "0123456789");
+	sb_insert(sb, 4, "-");
+	{
+		sb_iter it;
+		stringbuf *part = sb_alloc();
+
+		sb_iter_init(&it, sb, 3);
+		assert(sb_iter_next(&it) == '3');
+		assert(sb_iter_next(&it) == '-');
+		assert(sb_iter_next(&it) == '4');
+		assert(it.pos == 6 && it.index == 6);
+		assert(sb_iter_prev(&it) == '4');
+		assert(sb_iter_prev(&it) == '-');
+		sb_iter_init(&it, sb, 100);
+		assert(sb_iter_next(&it) == -1);
+		assert(sb_iter_prev(&it) == '9');
+		sb_iter_init(&it, sb, 0);
+		assert(sb_iter_prev(&it) == -1);
+
+		sb_append_part(part, sb, 2, 5);
+		assert(strcmp(sb_str(part), "23-45") == 0);
+		sb_append_part(part, sb, 9, 100);
+		validate_buf(part, "23-4589");
+	}
+	validate_buf(sb, "0123-456789");
+
+	/* Reading the parts as a refresh of the line does leaves the gap at the edit */
+	sb = sb_alloc();
+	sb_append(sb, "the quick brown fox jumps over the lazy dog");
+	sb_insert(sb, 10, "x");
+	{
+		char copy[64];
+		const char *text;
+		int offset = 0;
+		sb_iter it;
+
+		sb_iter_init(&it, sb, 11);
+		while (sb_iter_next(&it) >= 0) {
+		}
+		while (*(text = sb_part(sb, offset))) {
+			copy[offset++] = *text;
+		}
+		copy[offset] = 0;
+		assert(strcmp(copy, "the quick xbrown fox jumps over the lazy dog") == 0);
+		assert(sb_index(sb, 20) == 20);
+		assert(sb->gap == 11);
+		assert(sb_part(sb, sb_len(sb))[0] == 0);
+	}
+	validate_buf(sb, "the quick xbrown fox jumps over the lazy dog");
+
+	/* Move between the inline storage and an allocation, with the gap in the middle */
+	sb = sb_alloc();
+	sb_append(sb, "0123456789");
+	sb_insert(sb, 5, "-");
+	for (i = 0; i < 5; i++) {
+		sb_insert(sb, 6, "abcdefgh");
+	}
+	assert(sb_len(sb) == 51);
+	pt = sb_str(sb);
+	assert(memcmp(pt, "01234-abcdefghabcdefgh", 22) == 0);
+	assert(strcmp(pt + 46, "56789") == 0);
+	sb_delete(sb, 6, 40);
+	sb_shrink(sb);
+	sb_insert(sb, 2, "+");
+	validate_buf(sb, "01+234-56789");
+
+	sb = sb_alloc();
+	sb_reserve(sb, 1000);
+	pt = sb_str(sb);
+	for (i = 0; i < 1000; i++) {
+		sb_append(sb, "z");
+	}
+	/* Not reallocated */
+	assert(sb_str(sb) == pt);
+	assert(sb_len(sb) == 1000);
+	sb_delete(sb, 0, 999);
+	sb_shrink(sb);
+	pt = sb_to_string(sb);
+	assert(strcmp(pt, "z") == 0);
+	free(pt);
+
+	/* Everything comes from the given allocator */
+	{
+		int count = 0;
+		sb_allocator alloc = { counting_realloc, &count };
+
+		sb = sb_alloc_from(&alloc);
+		assert(count == 1);
+		for (i = 0; i < 100; i++) {
+			sb_insert(sb, 0, "ab");
+		}
+		sb_free(sb);
+		assert(count == 0);
+
+		sb_set_allocator(&alloc);
+		sb = sb_alloc();
+		sb_append(sb, "hi");
+		pt = sb_to_string(sb);
+		assert(count == 1);
+		counting_realloc(&count, pt, 0);
+		assert(count == 0);
+		sb_set_allocator(NULL);
+	}
+
 	/* OK to sb_free() a NULL pointer */
 	sb_free(NULL);
 
@@ -135,6 +389,84 @@ int main(void)
 	assert(sb_len(sb) == 6);
 	assert(sb_chars(sb) == 6);
 	validate_buf(sb, "onetwo");
+
+	sb = sb_alloc();
+	sb_append(sb, "aµb");
+	sb_insert(sb, 1, "€");
+	assert(sb_chars(sb) == 4);
+	assert(sb_index(sb, 1) == 1);
+	assert(sb_index(sb, 2) == 4);
+	assert(sb_index(sb, 3) == 6);
+	assert(sb_index(sb, 4) == 7);
+	sb_delete(sb, 4, 2);
+	assert(sb_chars(sb) == 3);
+	{
+		sb_iter it;
+
+		/* The gap is now after the € */
+		sb_iter_init(&it, sb, 3);
+		assert(sb_iter_prev(&it) == 'b');
+		assert(sb_iter_prev(&it) == 0x20ac);
+		assert(it.pos == 1 && it.index == 1);
+		assert(sb_iter_next(&it) == 0x20ac);
+		assert(sb_iter_next(&it) == 'b');
+	}
+	validate_buf(sb, "a€b");
+
+	/* No gap is left after sb_shrink(), so a delete must not lose a byte */
+	sb = sb_alloc();
+	for (i = 0; i < 20; i++) {
+		sb_append(sb, "é");
+	}
+	sb_shrink(sb);
+	sb_delete(sb, 10, 2);
+	assert(sb_len(sb) == 38);
+	assert(sb_chars(sb) == 19);
+	sb_free(sb);
+
+	/* The char index must follow edits anywhere in a long string */
+	sb = sb_alloc();
+	for (i = 0; i < 300; i++) {
+		sb_append(sb, (i % 3) ? "x" : "µ€");
+	}
+	srand(1);
+	for (i = 0; i < 2000; i++) {
+		int pos = rand() % (sb_chars(sb) + 1);
+		int offset = sb_index(sb, pos);
+		int j;
+
+		switch (rand() % 5) {
+			case 0:
+				sb_insert(sb, offset, (i % 2) ? "y" : "€");
+				break;
+			case 1:
+				sb_delete(sb, offset, sb_index(sb, pos + 1) - offset);
+				break;
+			case 2:
+				sb_append(sb, "µ");
+				break;
+			case 3:
+				sb_shrink(sb);
+				break;
+			default:
+				/* Check some lookups against utf8_index() */
+				pt = sb_str(sb);
+				for (j = 0; j <= sb_chars(sb); j += 7) {
+					assert(sb_index(sb, j) == utf8_index(pt, j));
+				}
+				assert(sb_chars(sb) == utf8_strlen(pt, -1));
+				break;
+		}
+		assert(sb_index(sb, pos) == offset);
+	}
+	sb_free(sb);
+#endif
+
+#ifdef SB_BENCHMARK
+	benchmark(argc > 1 ? atoi(argv[1]) : 16 << 20);
+#else
+	(void)argc;
+	(void)argv;
 #endif
 
 	return(0);
@@ -174,11 +174,11 @@ int utf8_tounicode(const char *str, int *uc)
 
 struct utf8range {
     int lower;     /* lower inclusive */
-    int upper;     /* upper exclusive */
+    int upper;     /* upper inclusive */
 };
 
 /* From http://unicode.org/Public/UNIDATA/UnicodeData.txt */
-static const struct utf8range unicode_range_combining[] = {
+static const int unicode_combining[] = {
     0x0300, 0x0301, 0x0302, 0x0303, 0x0304, 0x0305, 0x0306, 0x0307,
     0x0308, 0x0309, 0x030A, 0x030B, 0x030C, 0x030D, 0x030E, 0x030F,
     0x0310, 0x0311, 0x0312, 0x0313, 0x0314, 0x0315, 0x0316, 0x0317,
@@ -469,12 +469,17 @@ static int cmp_range(const void *key, const void *cm)
     if (ch < range->lower) {
         return -1;
     }
-    if (ch >= range->upper) {
+    if (ch > range->upper) {
         return 1;
     }
     return 0;
 }
 
+static int cmp_char(const void *key, const void *cm)
+{
+    return *(int *)key - *(const int *)cm;
+}
+
 static int utf8_in_range(const struct utf8range *range, int num, int ch)
 {
     const struct utf8range *r =
@@ -492,7 +497,7 @@ int utf8_width(int ch)
     if (isascii(ch)) {
         return 1;
     }
-    if (utf8_in_range(unicode_range_combining, ARRAYSIZE(unicode_range_combining), ch)) {
+    if (bsearch(&ch, unicode_combining, ARRAYSIZE(unicode_combining), sizeof(*unicode_combining), cmp_char)) {
         return 0;
     }
     if (utf8_in_range(unicode_range_wide, ARRAYSIZE(unicode_range_wide), ch)) {